@@ -0,0 +1,174 @@
+/*
+ * Asynchronous I/O
+ *
+ * sfs_aread/sfs_awrite queue a request and return its handle right away. A pool of ASYNC_THREADS worker threads,
+ * started by the first request, runs the queued requests through sfs_fread/sfs_fwrite (which are safe to call from
+ * several threads), so many requests can have block I/O in flight while the submitting thread carries on.
+ * Requests on the same file descriptor run one at a time, in the order they were submitted, so they see each
+ * other's read/write pointer moves just like consecutive blocking calls would.
+ * A request either has a callback, run on the worker thread once it completes, after which its handle is released,
+ * or is completed by sfs_apoll/sfs_await, which release the handle when they report the result.
+ */
+
+#include "async_io.h"
+
+#include "sfs_api.h"
+#include <pthread.h>
+
+#define ASYNC_THREADS 4//worker threads running requests
+
+enum {REQ_FREE, REQ_QUEUED, REQ_RUNNING, REQ_DONE};
+
+typedef struct {
+  int state;
+  int write;//1 for sfs_awrite, 0 for sfs_aread
+  int fileID;
+  char *buf;
+  int length;
+  SfsCallback callback;
+  void *arg;
+  int result;//bytes transferred, once done
+  long seq;//submission order, the oldest queued request runs first
+} AsyncRequest;
+
+static AsyncRequest requests[SFS_MAX_ASYNC_REQUESTS];
+static long nextSeq = 0;
+static int active = 0;//requests queued or running
+static int started = 0;//1 once the workers are running
+static pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;//guards every variable above
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;//a request was queued
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;//a request completed
+
+/*Returns 1 if a request on fileID is running.*/
+static int file_busy(int fileID) {
+  for (int request = 0; request < SFS_MAX_ASYNC_REQUESTS; ++request) {
+    if (requests[request].state == REQ_RUNNING && requests[request].fileID == fileID)
+      return 1;
+  }
+  return 0;
+}
+
+/*Returns the oldest queued request whose file descriptor has no running request, or -1 if there is none.
+ * Older requests on the same descriptor are just as eligible, so they run first and submission order is kept.*/
+static int request_next() {
+  int next = -1;
+  for (int request = 0; request < SFS_MAX_ASYNC_REQUESTS; ++request) {
+    if (requests[request].state != REQ_QUEUED) continue;
+    if (next >= 0 && requests[request].seq > requests[next].seq) continue;
+    if (!file_busy(requests[request].fileID))
+      next = request;
+  }
+  return next;
+}
+
+static void *worker(void *unused) {
+  (void) unused;
+  pthread_mutex_lock(&asyncLock);
+  for (;;) {
+    int request;
+    while ((request = request_next()) < 0)
+      pthread_cond_wait(&workReady, &asyncLock);
+    AsyncRequest *req = &requests[request];
+    req->state = REQ_RUNNING;
+    pthread_mutex_unlock(&asyncLock);
+    int result = req->write ? sfs_fwrite(req->fileID, req->buf, req->length)
+                            : sfs_fread(req->fileID, req->buf, req->length);
+    if (req->callback != NULL)
+      req->callback(request, result, req->arg);
+    pthread_mutex_lock(&asyncLock);
+    req->result = result;
+    req->state = req->callback != NULL ? REQ_FREE : REQ_DONE;
+    active--;
+    //the descriptor is free again, a request queued behind this one may run now
+    pthread_cond_broadcast(&workReady);
+    pthread_cond_broadcast(&workDone);
+  }
+  return NULL;
+}
+
+/*Queues a request and returns its handle, or -1 if SFS_MAX_ASYNC_REQUESTS are already pending.*/
+static int request_submit(int write, int fileID, char *buf, int length, SfsCallback callback, void *arg) {
+  pthread_mutex_lock(&asyncLock);
+  if (!started) {
+    for (int i = 0; i < ASYNC_THREADS; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, worker, NULL) == 0) {
+        pthread_detach(thread);
+        started = 1;
+      }
+    }
+  }
+  int request = -1;
+  for (int i = 0; started && i < SFS_MAX_ASYNC_REQUESTS && request < 0; ++i) {
+    if (requests[i].state == REQ_FREE)
+      request = i;
+  }
+  if (request >= 0) {
+    AsyncRequest *req = &requests[request];
+    req->state = REQ_QUEUED;
+    req->write = write;
+    req->fileID = fileID;
+    req->buf = buf;
+    req->length = length;
+    req->callback = callback;
+    req->arg = arg;
+    req->seq = nextSeq++;
+    active++;
+    pthread_cond_broadcast(&workReady);
+  }
+  pthread_mutex_unlock(&asyncLock);
+  return request;
+}
+
+/*Starts reading length bytes from the file into buf. Returns the request handle, -1 on failure.*/
+int sfs_aread(int fileID, char *buf, int length, SfsCallback callback, void *arg) {
+  return request_submit(0, fileID, buf, length, callback, arg);
+}
+
+/*Starts writing length bytes from buf to the file, buf must stay untouched until the request completes.
+ * Returns the request handle, -1 on failure.*/
+int sfs_awrite(int fileID, char *buf, int length, SfsCallback callback, void *arg) {
+  return request_submit(1, fileID, buf, length, callback, arg);
+}
+
+/*Returns 1 and sets *result if the request completed (its handle is released), 0 if it is still pending,
+ * -1 if request is not a pending request without callback.*/
+int sfs_apoll(int request, int *result) {
+  if (request < 0 || request >= SFS_MAX_ASYNC_REQUESTS) return -1;
+  pthread_mutex_lock(&asyncLock);
+  AsyncRequest *req = &requests[request];
+  int status = 0;
+  if (req->state == REQ_FREE || req->callback != NULL) {
+    status = -1;
+  } else if (req->state == REQ_DONE) {
+    *result = req->result;
+    req->state = REQ_FREE;
+    status = 1;
+  }
+  pthread_mutex_unlock(&asyncLock);
+  return status;
+}
+
+/*Waits for a request to complete and returns its result (its handle is released).
+ * Returns -1 if request is not a pending request without callback.*/
+int sfs_await(int request) {
+  if (request < 0 || request >= SFS_MAX_ASYNC_REQUESTS) return -1;
+  pthread_mutex_lock(&asyncLock);
+  AsyncRequest *req = &requests[request];
+  int result = -1;
+  if (req->state != REQ_FREE && req->callback == NULL) {
+    while (req->state != REQ_DONE)
+      pthread_cond_wait(&workDone, &asyncLock);
+    result = req->result;
+    req->state = REQ_FREE;
+  }
+  pthread_mutex_unlock(&asyncLock);
+  return result;
+}
+
+void async_drain() {
+  pthread_mutex_lock(&asyncLock);
+  while (active > 0)
+    pthread_cond_wait(&workDone, &asyncLock);
+  pthread_mutex_unlock(&asyncLock);
+}
@@ -0,0 +1,4 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+void async_drain(); // waits until every submitted request has completed
+#endif
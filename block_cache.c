@@ -0,0 +1,560 @@
+/*
+ * Block Cache
+ *
+ * Write-back buffer cache between sfs_api.c and disk_emu.c.
+ * Cached blocks live in a fixed number of slots, are found through a chained hash table and are evicted with the
+ * CLOCK (second chance) algorithm. A dirty block only reaches the disk when it is evicted or on cache_sync().
+ * Held blocks (see cache_hold) are never evicted or written back, the journal writes them out itself. A block that
+ * can't get a slot (every slot is held, or the victim can't be written back) is read or written without caching it.
+ * Every function takes cacheLock, so the cache can be shared by several threads, but the lock is dropped while a
+ * request is at the disk: the slots involved are marked as having I/O in flight (see SlotIO) and other threads wait
+ * on ioDone for the ones they need, so requests for other blocks proceed in parallel. Blocks are copied in and out of
+ * the cache, so no caller ever keeps a pointer into it.
+ */
+
+#include "block_cache.h"
+
+#include "disk_emu.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_CAPACITY 64//number of cached blocks unless cache_setCapacity() says otherwise
+#define NO_SLOT -1//slot_claim: every slot is held, or the victim could not be written back
+#define SLOT_BUSY -2//slot_claim: every slot that could be reused has I/O in flight, wait for ioDone and try again
+#define SLOT_TAKEN -3//slot_claim: another thread cached the block while cacheLock was dropped
+
+/*I/O in flight on a slot. cacheLock isn't held during the request, so the slot can't be reused until it ends.*/
+typedef enum {
+  IO_NONE,
+  IO_READ,//the block is being read into the slot, its data isn't valid yet
+  IO_WRITE//the block is being written back from the slot, it may be read but not changed
+} SlotIO;
+
+typedef struct {
+  int blockNum;//disk address of the cached block, -1 if the slot is unused
+  char dirty;//1 if the block changed since it was last written to disk
+  char ref;//CLOCK reference bit, set on every access
+  char held;//1 while the block belongs to an uncommitted journal transaction
+  char io;//SlotIO of the request in flight
+  int hashNext;//next slot in the same hash bucket, -1 ends the chain
+} CacheSlot;
+
+static int capacity = DEFAULT_CAPACITY;//number of slots
+static int blockBytes = 0;//size in bytes of a block, 0 while the cache is not initialized
+static CacheSlot *slots = NULL;
+static char *slotData = NULL;//block data, slot i starts at slotData + i * blockBytes
+static int *buckets = NULL;//hash table of slot indices, -1 if the bucket is empty
+static unsigned int bucketMask = 0;//number of buckets - 1 (number of buckets is a power of 2)
+static int slotsUsed = 0;//slots [0, slotsUsed) have held a block since the cache was created
+static int clockHand = 0;
+static int heldCount = 0;//number of held slots
+static int ioCount = 0;//number of slots with I/O in flight
+static CacheStats stats;
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;//guards every variable above
+static pthread_cond_t ioDone = PTHREAD_COND_INITIALIZER;//the I/O on a slot ended
+
+static unsigned int hash(int blockNum) {
+  return ((unsigned int) blockNum * 2654435761u) & bucketMask;//Knuth's multiplicative hash
+}
+
+static char *slot_data(int slot) {
+  return slotData + (long) slot * blockBytes;
+}
+
+/*Returns the slot holding blockNum, or -1 if the block is not cached.*/
+static int slot_find(int blockNum) {
+  for (int slot = buckets[hash(blockNum)]; slot != -1; slot = slots[slot].hashNext) {
+    if (slots[slot].blockNum == blockNum)
+      return slot;
+  }
+  return -1;
+}
+
+/*Removes a slot from its hash chain.*/
+static void slot_unlink(int slot) {
+  int *link = &buckets[hash(slots[slot].blockNum)];
+  while (*link != slot)
+    link = &slots[*link].hashNext;
+  *link = slots[slot].hashNext;
+}
+
+/*Empties a slot, slot_victim hands it out before evicting anything.*/
+static void slot_drop(int slot) {
+  slot_unlink(slot);
+  slots[slot].blockNum = -1;
+  slots[slot].dirty = 0;
+  slots[slot].ref = 0;
+}
+
+/*Marks a request in flight on a slot, cacheLock may be dropped until slot_ioEnd.*/
+static void slot_ioBegin(int slot, char io) {
+  slots[slot].io = io;
+  ioCount++;
+}
+
+/*Ends the request on a slot and wakes the threads waiting for one.*/
+static void slot_ioEnd(int slot) {
+  slots[slot].io = IO_NONE;
+  ioCount--;
+  pthread_cond_broadcast(&ioDone);
+}
+
+/*Waits for a request in flight to end, returns right away if there is none. cacheLock is dropped while waiting, so
+ * the caller must look up its slots again. It must have no request in flight itself.*/
+static void io_wait() {
+  if (ioCount > 0)
+    pthread_cond_wait(&ioDone, &cacheLock);
+}
+
+/*Writes the dirty block of a slot back to disk, cacheLock is dropped during the request. Returns -1 on failure.*/
+static int slot_writeBack(int slot) {
+  int blockNum = slots[slot].blockNum;
+  slot_ioBegin(slot, IO_WRITE);
+  pthread_mutex_unlock(&cacheLock);
+  int result = write_blocks(blockNum, 1, slot_data(slot));
+  pthread_mutex_lock(&cacheLock);
+  if (result >= 0) {
+    slots[slot].dirty = 0;
+    stats.writebacks++;
+  }
+  slot_ioEnd(slot);
+  return result;
+}
+
+/*Returns an empty slot, evicting the CLOCK victim if every slot is taken. A dirty victim is written back first.
+ * Returns NO_SLOT if the victim could not be written back or every slot is held, SLOT_BUSY if the slots that could
+ * be reused have I/O in flight or were used again while a victim was written back.*/
+static int slot_victim() {
+  if (slotsUsed < capacity)
+    return slotsUsed++;
+  int busy = 0;
+  //a victim is found within two sweeps of the clock hand if any slot isn't held or busy
+  for (int checked = 0; checked < 2 * capacity; ++checked) {
+    int slot = clockHand;
+    clockHand = (clockHand + 1) % capacity;
+    if (slots[slot].held) continue;
+    if (slots[slot].io != IO_NONE) {
+      busy = 1;
+      continue;
+    }
+    if (slots[slot].blockNum < 0) return slot;//dropped, nothing to evict
+    if (slots[slot].ref) {//recently used, give it a second chance
+      slots[slot].ref = 0;
+      continue;
+    }
+    if (slots[slot].dirty) {
+      if (slot_writeBack(slot) < 0) return NO_SLOT;
+      if (slots[slot].held || slots[slot].io != IO_NONE || slots[slot].dirty || slots[slot].ref) {
+        busy = 1;//used again while cacheLock was dropped
+        continue;
+      }
+    }
+    slot_drop(slot);
+    stats.evictions++;
+    return slot;
+  }
+  return busy ? SLOT_BUSY : NO_SLOT;
+}
+
+/*Assigns a slot to blockNum, which must not be cached, and starts a request of type io on it (none for IO_NONE).
+ * cacheLock may be dropped while a victim is written back. Returns the slot, NO_SLOT or SLOT_BUSY (see slot_victim)
+ * or SLOT_TAKEN if another thread cached blockNum meanwhile.*/
+static int slot_claim(int blockNum, char io) {
+  int slot = slot_victim();
+  if (slot < 0) return slot;
+  if (slot_find(blockNum) >= 0) return SLOT_TAKEN;//the empty slot is handed out again by slot_victim
+  unsigned int bucket = hash(blockNum);
+  slots[slot].blockNum = blockNum;
+  slots[slot].dirty = 0;
+  slots[slot].ref = 1;
+  slots[slot].held = 0;
+  slots[slot].hashNext = buckets[bucket];
+  buckets[bucket] = slot;
+  if (io != IO_NONE)
+    slot_ioBegin(slot, io);
+  return slot;
+}
+
+static void cache_free();
+static int cache_syncAll();
+
+/*Does the work of cache_init, cacheLock must be held.*/
+static int cache_build(int blockSize) {
+  cache_free();
+  int bucketCount = 1;
+  while (bucketCount < 2 * capacity)
+    bucketCount <<= 1;
+  slots = malloc(sizeof(CacheSlot) * capacity);
+  slotData = malloc((size_t) capacity * blockSize);
+  buckets = malloc(sizeof(int) * bucketCount);
+  if (slots == NULL || slotData == NULL || buckets == NULL) {
+    cache_free();
+    return -1;
+  }
+  for (int slot = 0; slot < capacity; ++slot) {
+    slots[slot].blockNum = -1;
+    slots[slot].dirty = 0;
+    slots[slot].ref = 0;
+    slots[slot].held = 0;
+    slots[slot].io = IO_NONE;
+  }
+  memset(buckets, -1, sizeof(int) * bucketCount);
+  bucketMask = (unsigned int) bucketCount - 1;
+  blockBytes = blockSize;
+  slotsUsed = 0;
+  clockHand = 0;
+  heldCount = 0;
+  return 0;
+}
+
+/*Does the work of cache_close, cacheLock must be held.*/
+static void cache_free() {
+  if (blockBytes > 0)
+    cache_syncAll();
+  while (ioCount > 0)//requests other threads still have in flight use the slots
+    pthread_cond_wait(&ioDone, &cacheLock);
+  free(slots);
+  free(slotData);
+  free(buckets);
+  slots = NULL;
+  slotData = NULL;
+  buckets = NULL;
+  blockBytes = 0;
+}
+
+int cache_init(int blockSize) {
+  pthread_mutex_lock(&cacheLock);
+  int result = cache_build(blockSize);
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+void cache_close() {
+  pthread_mutex_lock(&cacheLock);
+  cache_free();
+  pthread_mutex_unlock(&cacheLock);
+}
+
+int cache_getCapacity() {
+  pthread_mutex_lock(&cacheLock);
+  int result = capacity;
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+int cache_setCapacity(int newCapacity) {
+  pthread_mutex_lock(&cacheLock);
+  int result = 0;
+  if (newCapacity < 1 || heldCount > 0) {//held blocks can't be dropped or written back
+    result = -1;
+  } else {
+    int blockSize = blockBytes;
+    capacity = newCapacity;
+    if (blockSize > 0)//cache is live, rebuild it with the new capacity
+      result = cache_build(blockSize);
+  }
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+/*Ends the IO_READ requests on the slots of the count blocks starting at blockNum, which were read into buf if
+ * result isn't negative. The slots are dropped if the read failed.*/
+static void slots_loaded(int blockNum, int count, const char *buf, int result) {
+  for (int i = 0; i < count; ++i) {
+    int slot = slot_find(blockNum + i);
+    if (result >= 0)
+      memcpy(slot_data(slot), buf + (long) i * blockBytes, blockBytes);
+    slot_ioEnd(slot);
+    if (result < 0)
+      slot_drop(slot);
+  }
+}
+
+/*Does the work of cache_read, cacheLock must be held.*/
+static int cache_readBlocks(int blockNum, int nblocks, void *buf) {
+  char *out = buf;
+  int i = 0;
+  while (i < nblocks) {
+    int slot = slot_find(blockNum + i);
+    if (slot >= 0) {//hit
+      if (slots[slot].io == IO_READ) {//another thread is reading it
+        io_wait();
+        continue;
+      }
+      memcpy(out + (long) i * blockBytes, slot_data(slot), blockBytes);
+      slots[slot].ref = 1;
+      stats.hits++;
+      i++;
+      continue;
+    }
+    //miss, claim slots for the run of uncached blocks, then read it with one disk request straight into buf
+    int run = 0;
+    int claimed = 0;
+    while (i + run < nblocks && slot_find(blockNum + i + run) < 0
+           && (claimed = slot_claim(blockNum + i + run, IO_READ)) >= 0)
+      run++;
+    if (run == 0 && claimed == SLOT_BUSY) {
+      io_wait();
+      continue;
+    }
+    if (run == 0 && claimed == SLOT_TAKEN) continue;
+    int uncached = run == 0;//every slot is held, the block is read without caching it
+    if (uncached)
+      run = 1;
+    pthread_mutex_unlock(&cacheLock);
+    int result = read_blocks(blockNum + i, run, out + (long) i * blockBytes);
+    pthread_mutex_lock(&cacheLock);
+    if (!uncached)
+      slots_loaded(blockNum + i, run, out + (long) i * blockBytes, result);
+    if (result < 0) return -1;
+    stats.misses += run;
+    i += run;
+  }
+  return nblocks;
+}
+
+int cache_read(int blockNum, int nblocks, void *buf) {
+  pthread_mutex_lock(&cacheLock);
+  int result = cache_readBlocks(blockNum, nblocks, buf);
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+/*Does the work of cache_prefetch, cacheLock must be held.*/
+static int cache_prefetchBlocks(int blockNum, int nblocks) {
+  if (blockBytes == 0) return 0;
+  char *buff = NULL;//staging buffer for the runs read, allocated by the first miss
+  int fetched = 0;
+  int i = 0;
+  while (i < nblocks) {
+    if (slot_find(blockNum + i) >= 0) {//already cached
+      i++;
+      continue;
+    }
+    //claim slots for the run of uncached blocks, then read it with one disk request
+    int run = 0;
+    while (i + run < nblocks && slot_find(blockNum + i + run) < 0 && slot_claim(blockNum + i + run, IO_READ) >= 0)
+      run++;
+    if (run == 0) break;//no slot can be had right now, prefetching is only a hint
+    if (buff == NULL && (buff = malloc((size_t) nblocks * blockBytes)) == NULL) {
+      slots_loaded(blockNum + i, run, NULL, -1);
+      return -1;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    int result = read_blocks(blockNum + i, run, buff);
+    pthread_mutex_lock(&cacheLock);
+    slots_loaded(blockNum + i, run, buff, result);
+    if (result < 0) {
+      free(buff);
+      return -1;
+    }
+    stats.prefetches += run;
+    fetched += run;
+    i += run;
+  }
+  free(buff);
+  return fetched;
+}
+
+int cache_prefetch(int blockNum, int nblocks) {
+  pthread_mutex_lock(&cacheLock);
+  int result = cache_prefetchBlocks(blockNum, nblocks);
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+int cache_write(int blockNum, int nblocks, const void *buf) {
+  const char *in = buf;
+  pthread_mutex_lock(&cacheLock);
+  int result = nblocks;
+  int i = 0;
+  while (i < nblocks) {
+    int slot = slot_find(blockNum + i);
+    if (slot >= 0 && slots[slot].io != IO_NONE) {//it can't change until the request on it ends
+      io_wait();
+      continue;
+    }
+    if (slot < 0 && (slot = slot_claim(blockNum + i, IO_NONE)) < 0) {
+      if (slot == NO_SLOT) {//every slot is held or the victim couldn't be written back, write the block through
+        pthread_mutex_unlock(&cacheLock);
+        int written = write_blocks(blockNum + i, 1, (char *) in + (long) i * blockBytes);
+        pthread_mutex_lock(&cacheLock);
+        if (written < 0) {
+          result = -1;
+          break;
+        }
+        i++;
+        continue;
+      }
+      if (slot == SLOT_BUSY)
+        io_wait();
+      continue;
+    }
+    memcpy(slot_data(slot), in + (long) i * blockBytes, blockBytes);
+    slots[slot].dirty = 1;
+    slots[slot].ref = 1;
+    i++;
+  }
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+static int compareInt(const void *a, const void *b) {
+  return *(const int *) a - *(const int *) b;
+}
+
+/*Writes back the dirty blocks among the count block numbers in pending (in ascending order), one request per run of
+ * consecutive blocks, with cacheLock dropped while writing. Blocks another thread is writing back are waited for, and
+ * written again if that failed. pending is overwritten. Returns 0 on success, -1 if a block could not be written.*/
+static int cache_flush(int *pending, int count) {
+  if (count == 0) return 0;
+  int *batch = malloc(sizeof(int) * count);//slots claimed by a pass, in disk order
+  char *failed = malloc(count);//1 for each slot of the batch that could not be written
+  char *stage = malloc((size_t) count * blockBytes);//staging buffer for a run
+  int result = 0;
+  if (batch == NULL || failed == NULL || stage == NULL)
+    count = result = -1;
+  while (count > 0) {
+    int claimed = 0;
+    int left = 0;
+    for (int i = 0; i < count; ++i) {
+      int slot = slot_find(pending[i]);
+      if (slot < 0 || !slots[slot].dirty || slots[slot].held) continue;//written back since, or held by the journal
+      if (slots[slot].io != IO_NONE) {//another thread is writing it back
+        pending[left++] = pending[i];
+        continue;
+      }
+      slot_ioBegin(slot, IO_WRITE);
+      batch[claimed++] = slot;
+    }
+    count = left;
+    if (claimed == 0) {
+      if (count > 0)//only blocks other threads are writing back are left, wait for them
+        io_wait();
+      continue;
+    }
+    //a slot being written back can't change, so the runs are staged without cacheLock
+    pthread_mutex_unlock(&cacheLock);
+    for (int i = 0; i < claimed; ) {
+      int start = slots[batch[i]].blockNum;
+      int run = 1;
+      while (i + run < claimed && slots[batch[i + run]].blockNum == start + run)
+        run++;
+      char *data = slot_data(batch[i]);
+      if (run > 1) {
+        for (int j = 0; j < run; ++j)
+          memcpy(stage + (long) j * blockBytes, slot_data(batch[i + j]), blockBytes);
+        data = stage;
+      }
+      memset(failed + i, write_blocks(start, run, data) < 0, run);
+      i += run;
+    }
+    pthread_mutex_lock(&cacheLock);
+    for (int i = 0; i < claimed; ++i) {
+      if (failed[i]) {
+        result = -1;
+      } else {
+        slots[batch[i]].dirty = 0;
+        stats.writebacks++;
+      }
+      slot_ioEnd(batch[i]);
+    }
+  }
+  free(batch);
+  free(failed);
+  free(stage);
+  return result;
+}
+
+/*Does the work of cache_sync, cacheLock must be held.*/
+static int cache_syncAll() {
+  if (blockBytes == 0) return 0;
+  //gather the dirty blocks in disk order so consecutive blocks go out in a single request
+  int *pending = malloc(sizeof(int) * capacity);
+  if (pending == NULL) return -1;
+  int count = 0;
+  for (int slot = 0; slot < slotsUsed; ++slot) {
+    if (slots[slot].dirty && !slots[slot].held)
+      pending[count++] = slots[slot].blockNum;
+  }
+  qsort(pending, count, sizeof(int), compareInt);
+  int result = cache_flush(pending, count);
+  free(pending);
+  return result;
+}
+
+int cache_sync() {
+  pthread_mutex_lock(&cacheLock);
+  int result = cache_syncAll();
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+/*Does the work of cache_syncRange, cacheLock must be held.*/
+static int cache_syncBlocks(int blockNum, int nblocks) {
+  if (blockBytes == 0 || nblocks <= 0) return 0;
+  int *pending = malloc(sizeof(int) * (nblocks < capacity ? nblocks : capacity));
+  if (pending == NULL) return -1;
+  int count = 0;//each dirty block has a slot, so there are at most capacity of them
+  for (int i = 0; i < nblocks && count < capacity; ++i) {
+    int slot = slot_find(blockNum + i);
+    if (slot >= 0 && slots[slot].dirty && !slots[slot].held)
+      pending[count++] = blockNum + i;
+  }
+  int result = cache_flush(pending, count);
+  free(pending);
+  return result;
+}
+
+int cache_syncRange(int blockNum, int nblocks) {
+  pthread_mutex_lock(&cacheLock);
+  int result = cache_syncBlocks(blockNum, nblocks);
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+int cache_hold(int blockNum) {
+  pthread_mutex_lock(&cacheLock);
+  int result = -1;
+  int slot = blockBytes == 0 ? -1 : slot_find(blockNum);
+  if (slot >= 0) {
+    result = !slots[slot].held;
+    if (!slots[slot].held) {
+      slots[slot].held = 1;
+      heldCount++;
+    }
+  }
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+void cache_release(int blockNum) {
+  pthread_mutex_lock(&cacheLock);
+  int slot = blockBytes == 0 ? -1 : slot_find(blockNum);
+  if (slot >= 0 && slots[slot].held) {
+    slots[slot].held = 0;
+    heldCount--;
+  }
+  pthread_mutex_unlock(&cacheLock);
+}
+
+CacheStats cache_getStats() {
+  pthread_mutex_lock(&cacheLock);
+  CacheStats result = stats;
+  pthread_mutex_unlock(&cacheLock);
+  return result;
+}
+
+double cache_hitRate() {
+  CacheStats counters = cache_getStats();
+  long lookups = counters.hits + counters.misses;
+  if (lookups == 0) return 0;
+  return (double) counters.hits / lookups;
+}
+
+void cache_resetStats() {
+  pthread_mutex_lock(&cacheLock);
+  memset(&stats, 0, sizeof(stats));
+  pthread_mutex_unlock(&cacheLock);
+}
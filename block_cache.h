@@ -0,0 +1,18 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+typedef struct {long hits; long misses; long writebacks; long evictions; long prefetches;} CacheStats;//block cache counters
+int cache_init(int blockBytes); // creates an empty cache of blockBytes sized blocks using the configured capacity
+void cache_close(); // writes back every dirty block that isn't held and releases the cache
+int cache_getCapacity(); // returns the number of cached blocks
+int cache_setCapacity(int capacity); // sets the number of cached blocks (dirty blocks are written back first), fails while blocks are held
+int cache_read(int blockNum, int nblocks, void *buf); // reads nblocks blocks starting at blockNum into buf
+int cache_prefetch(int blockNum, int nblocks); // reads the uncached blocks among nblocks blocks starting at blockNum into the cache. Returns the number read, -1 on failure
+int cache_write(int blockNum, int nblocks, const void *buf); // writes nblocks blocks from buf starting at blockNum (straight to disk if no slot can be had)
+int cache_sync(); // writes every dirty block that isn't held back to disk
+int cache_syncRange(int blockNum, int nblocks); // writes back the dirty blocks that aren't held among nblocks blocks starting at blockNum
+int cache_hold(int blockNum); // keeps a cached block resident and unwritten until released. Returns 1 if newly held, 0 if already held, -1 if not cached
+void cache_release(int blockNum); // ends cache_hold, the block is written back like any other dirty block
+CacheStats cache_getStats(); // returns the cache counters
+double cache_hitRate(); // returns hits / (hits + misses), or 0 if nothing was looked up yet
+void cache_resetStats(); // sets all cache counters back to 0
+#endif
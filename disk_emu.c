@@ -2,63 +2,535 @@
 #include <stdlib.h> 
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "disk_emu.h"
 
 
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+int BLOCK_SIZE, MAX_BLOCK;
+static const DiskBackend* backend = NULL;
+static int disk_open = 0;
+/*Request counters, updated atomically so that threads sharing the disk don't need a lock*/
+static DiskStats stats;
+static __thread long thread_blocks = 0;
+/*Block I/O trace, see start_disk_trace*/
+static FILE* trace_file = NULL;
+static int trace_env_checked = 0;//1 once SFS_DISK_TRACE was looked up
+static double trace_last_us = 0;//time of the previous record
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;//guards the trace state
+static __thread int thread_origin = TRACE_NO_ORIGIN;
+
+/*==================================================================*/
+/*File backend: the image is a host file accessed with pread/pwrite */
+/*==================================================================*/
+static int file_fd = -1;
+
+static int file_open(char *filename, long size, int fresh)
+{
+    if (!fresh)
+    {
+        file_fd = open(filename, O_RDWR);
+        return file_fd == -1 ? -1 : 0;
+    }
+
+    file_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file_fd == -1)
+        return -1;
+
+    /*Extends the empty file to its given size without writing it: the file is sparse and reads as 0's,
+      so creating a disk takes the same time whatever its size*/
+    if (ftruncate(file_fd, size) != 0)
+    {
+        close(file_fd);
+        file_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int file_read(long offset, long length, void *buffer)
+{
+    long done = 0;
+
+    /*Reads straight into the caller's buffer, a short read only happens at the end of the file*/
+    while (done < length)
+    {
+        ssize_t n = pread(file_fd, (char*)buffer + done, length - done, offset + done);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+        {
+            /*Past the end of the image, unwritten blocks read as 0's*/
+            memset((char*)buffer + done, 0, length - done);
+            break;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int file_write(long offset, long length, void *buffer)
+{
+    long done = 0;
+
+    /*Writes straight from the caller's buffer, nothing is flushed until sync_disk()*/
+    while (done < length)
+    {
+        ssize_t n = pwrite(file_fd, (char*)buffer + done, length - done, offset + done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int file_sync()
+{
+    return fsync(file_fd);
+}
+
+static int file_close()
+{
+    close(file_fd);
+    file_fd = -1;
+    return 0;
+}
+
+const DiskBackend FILE_DISK = {"file", file_open, file_read, file_write, file_sync, file_close};
+
+/*==================================================================*/
+/*RAM backend: the image only lives in memory. It survives          */
+/*close_disk() so that a disk can be re-opened by name, and is      */
+/*released when a fresh disk replaces it.                           */
+/*==================================================================*/
+static char* ram_image = NULL;
+static char* ram_name = NULL;
+static long ram_size = 0;
+
+static int ram_open(char *filename, long size, int fresh)
+{
+    if (!fresh)
+    {
+        /*Only the image created last can be re-opened*/
+        if (ram_image == NULL || strcmp(ram_name, filename) != 0 || ram_size < size)
+            return -1;
+        return 0;
+    }
+
+    free(ram_image);
+    free(ram_name);
+    ram_image = calloc(1, size);
+    ram_name = strdup(filename);
+    ram_size = size;
+    if (ram_image == NULL || ram_name == NULL)
+        return -1;
+    return 0;
+}
+
+static int ram_read(long offset, long length, void *buffer)
+{
+    memcpy(buffer, ram_image + offset, length);
+    return 0;
+}
+
+static int ram_write(long offset, long length, void *buffer)
+{
+    memcpy(ram_image + offset, buffer, length);
+    return 0;
+}
+
+static int ram_sync()
+{
+    return 0;
+}
+
+static int ram_close()
+{
+    return 0;
+}
+
+const DiskBackend RAM_DISK = {"ram", ram_open, ram_read, ram_write, ram_sync, ram_close};
+
+/*==================================================================*/
+/*mmap backend: the image file is mapped, reads and writes are      */
+/*plain memcpy's and only sync_disk() issues a system call          */
+/*==================================================================*/
+static int mmap_fd = -1;
+static char* mmap_image = NULL;
+static long mmap_size = 0;
+
+static int mmap_open(char *filename, long size, int fresh)
+{
+    if (fresh)
+        mmap_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    else
+        mmap_fd = open(filename, O_RDWR);
+    if (mmap_fd == -1)
+        return -1;
+
+    /*A fresh image is extended to its size, the new bytes read as 0's*/
+    if ((fresh || lseek(mmap_fd, 0, SEEK_END) < size) && ftruncate(mmap_fd, size) != 0)
+    {
+        close(mmap_fd);
+        mmap_fd = -1;
+        return -1;
+    }
+
+    mmap_image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mmap_fd, 0);
+    if (mmap_image == MAP_FAILED)
+    {
+        mmap_image = NULL;
+        close(mmap_fd);
+        mmap_fd = -1;
+        return -1;
+    }
+    mmap_size = size;
+    return 0;
+}
+
+static int mmap_read(long offset, long length, void *buffer)
+{
+    memcpy(buffer, mmap_image + offset, length);
+    return 0;
+}
+
+static int mmap_write(long offset, long length, void *buffer)
+{
+    memcpy(mmap_image + offset, buffer, length);
+    return 0;
+}
+
+static int mmap_sync()
+{
+    return msync(mmap_image, mmap_size, MS_SYNC);
+}
+
+static int mmap_close()
+{
+    munmap(mmap_image, mmap_size);
+    close(mmap_fd);
+    mmap_image = NULL;
+    mmap_fd = -1;
+    return 0;
+}
+
+const DiskBackend MMAP_DISK = {"mmap", mmap_open, mmap_read, mmap_write, mmap_sync, mmap_close};
+
+/*==================================================================*/
+/*Device model: how long each request takes, see DiskModel          */
+/*==================================================================*/
+const DiskModel NO_LATENCY = {"none", 0, 0, 0, 0, 1, 0, 0, 0};
+const DiskModel HDD_MODEL = {"hdd", 4000, 6.5, 0.1, 8000, 1, 0, 3, 1};
+const DiskModel SSD_MODEL = {"ssd", 60, 0.25, 0, 0, 32, 0, 3, 1};
+
+static const DiskModel* model = NULL;
+static int model_active = 0;//0 while the model neither takes time nor fails, read_blocks/write_blocks skip it
+static pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;//guards the model state below and the timing stats
+static long model_head = 0;//block following the previous request
+static double model_idle[MAX_QUEUE_DEPTH];//time (in us) each queue slot finishes its current request
+static unsigned long model_seed = 1;//failures are drawn from a fixed sequence so that runs can be reproduced
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*Returns a number in [0, 1) from the failure sequence*/
+static double model_random()
+{
+    model_seed = model_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (model_seed >> 11) / 9007199254740992.0;
+}
+
+/*Returns the modeled time of one attempt at a request and moves the head past it*/
+static double model_attempt(int start_address, int nblocks)
+{
+    double seek = labs(start_address - model_head) * model->seek_us_per_block;
+
+    if (seek > model->max_seek_us)
+        seek = model->max_seek_us;
+    model_head = start_address + nblocks;
+    return model->request_us + seek + (double)nblocks * BLOCK_SIZE / 1024 * model->kib_us;
+}
+
+/*------------------------------------------------------------------*/
+/*Selects the backend used by the next init_disk/init_fresh_disk.   */
+/*Fails while a disk is open.                                       */
+/*------------------------------------------------------------------*/
+int set_disk_backend(const DiskBackend *new_backend)
+{
+    if (disk_open)
+        return -1;
+    backend = new_backend;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the selected backend. Unless one was set, it is chosen by */
+/*the SFS_DISK_BACKEND environment variable (file, ram or mmap) and */
+/*defaults to the file backend                                      */
+/*------------------------------------------------------------------*/
+const DiskBackend *get_disk_backend()
+{
+    if (backend == NULL)
+    {
+        const DiskBackend* known[] = {&FILE_DISK, &RAM_DISK, &MMAP_DISK};
+        char* name = getenv("SFS_DISK_BACKEND");
+        int i;
+
+        backend = &FILE_DISK;
+        for (i = 0; name != NULL && i < 3; i++)
+        {
+            if (strcmp(name, known[i]->name) == 0)
+                backend = known[i];
+        }
+    }
+    return backend;
+}
+
+/*------------------------------------------------------------------*/
+/*Selects the device model timing read_blocks/write_blocks and      */
+/*restarts it (idle queue, head at block 0, first failure draw)     */
+/*------------------------------------------------------------------*/
+int set_disk_model(const DiskModel *new_model)
+{
+    if (new_model->queue_depth < 1 || new_model->queue_depth > MAX_QUEUE_DEPTH || new_model->max_retry < 0)
+        return -1;
+    pthread_mutex_lock(&model_lock);
+    model = new_model;
+    model_active = model->request_us > 0 || model->kib_us > 0 || model->seek_us_per_block > 0 ||
+                   model->failure_p > 0;
+    model_head = 0;
+    memset(model_idle, 0, sizeof(model_idle));
+    model_seed = 1;
+    pthread_mutex_unlock(&model_lock);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the selected device model. Unless one was set, it is      */
+/*chosen by the SFS_DISK_MODEL environment variable (none, hdd or   */
+/*ssd) and defaults to no latency                                   */
+/*------------------------------------------------------------------*/
+const DiskModel *get_disk_model()
+{
+    if (model == NULL)
+    {
+        const DiskModel* known[] = {&NO_LATENCY, &HDD_MODEL, &SSD_MODEL};
+        char* name = getenv("SFS_DISK_MODEL");
+        const DiskModel* chosen = &NO_LATENCY;
+        int i;
+
+        for (i = 0; name != NULL && i < 3; i++)
+        {
+            if (strcmp(name, known[i]->name) == 0)
+                chosen = known[i];
+        }
+        set_disk_model(chosen);
+    }
+    return model;
+}
+
+/*------------------------------------------------------------------*/
+/*Runs a request through the device model: queues it behind the     */
+/*requests in flight, draws its failures and, if the model waits,   */
+/*sleeps until it completes. Returns 0 on success, -1 if every      */
+/*attempt failed                                                    */
+/*------------------------------------------------------------------*/
+static int model_request(int start_address, int nblocks)
+{
+    double service = 0, start, finish;
+    int attempt, slot = 0, failed = 1, i;
+    struct timespec until;
+
+    pthread_mutex_lock(&model_lock);
+    for (attempt = 0; attempt <= model->max_retry && failed; attempt++)
+    {
+        service += model_attempt(start_address, nblocks);
+        failed = model->failure_p > 0 && model_random() < model->failure_p;
+        if (failed && attempt < model->max_retry)
+            stats.retries++;
+    }
+    if (failed)
+        stats.failures++;
+    stats.service_us += service;
+
+    /*The request starts as soon as a slot of the queue is idle*/
+    for (i = 1; i < model->queue_depth; i++)
+    {
+        if (model_idle[i] < model_idle[slot])
+            slot = i;
+    }
+    start = now_us();
+    if (model_idle[slot] > start)
+        start = model_idle[slot];
+    finish = start + service;
+    model_idle[slot] = finish;
+    pthread_mutex_unlock(&model_lock);
+
+    if (model->wait)
+    {
+        until.tv_sec = (time_t)(finish / 1e6);
+        until.tv_nsec = (long)((finish - until.tv_sec * 1e6) * 1e3);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+            ;
+    }
+    return failed ? -1 : 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Appends a record to the trace. trace_lock must be held            */
+/*------------------------------------------------------------------*/
+static void trace_write(int op, int start_address, int nblocks, int origin)
+{
+    TraceRecord record;
+    double now = now_us();
+    long delta = (long)now - (long)trace_last_us;//whole microseconds, so the deltas add up without drift
+
+    memset(&record, 0, sizeof(record));
+    record.delta_us = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+    trace_last_us = now;
+    record.start = start_address;
+    record.nblocks = nblocks;
+    record.op = op;
+    record.origin = origin;
+    fwrite(&record, sizeof(record), 1, trace_file);
+}
+
+/*------------------------------------------------------------------*/
+/*Records a request in the trace if one is running                  */
+/*------------------------------------------------------------------*/
+static void trace_request(int op, int start_address, int nblocks)
+{
+    if (__atomic_load_n(&trace_file, __ATOMIC_ACQUIRE) == NULL)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL)
+        trace_write(op, start_address, nblocks, thread_origin);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Starts recording every request to filename, replacing its         */
+/*contents. Returns 0 on success, -1 on failure                     */
+/*------------------------------------------------------------------*/
+int start_disk_trace(const char *filename)
+{
+    FILE* file = fopen(filename, "wb");
+
+    if (file == NULL)
+        return -1;
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), file);
+    stop_disk_trace();
+    pthread_mutex_lock(&trace_lock);
+    trace_env_checked = 1;//an explicit trace replaces the one SFS_DISK_TRACE would start
+    trace_last_us = now_us();
+    __atomic_store_n(&trace_file, file, __ATOMIC_RELEASE);
+    if (disk_open)
+        trace_write(TRACE_OPEN, MAX_BLOCK, BLOCK_SIZE, TRACE_NO_ORIGIN);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Stops the trace and closes its file. Returns 0 on success, -1 if  */
+/*the file couldn't be written                                      */
+/*------------------------------------------------------------------*/
+int stop_disk_trace()
+{
+    int result = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL)
+    {
+        result = fclose(trace_file) == 0 ? 0 : -1;
+        __atomic_store_n(&trace_file, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return result;
+}
+
+/*------------------------------------------------------------------*/
+/*Tags the requests the calling thread makes from now on with       */
+/*origin in the trace                                               */
+/*------------------------------------------------------------------*/
+void set_disk_origin(int origin)
+{
+    thread_origin = origin >= 0 && origin < TRACE_NO_ORIGIN ? origin : TRACE_NO_ORIGIN;
+}
+
+/*------------------------------------------------------------------*/
+/*Records that a disk was opened. The first time, starts the trace  */
+/*named by the SFS_DISK_TRACE environment variable if it is set     */
+/*------------------------------------------------------------------*/
+static void trace_open()
+{
+    if (!trace_env_checked)
+    {
+        char* name = getenv("SFS_DISK_TRACE");
+
+        trace_env_checked = 1;
+        if (name != NULL && start_disk_trace(name) == 0)
+            return;//the trace starts with the disk's geometry
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL)
+        trace_write(TRACE_OPEN, MAX_BLOCK, BLOCK_SIZE, TRACE_NO_ORIGIN);
+    pthread_mutex_unlock(&trace_lock);
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
-    if(NULL != fp)
+    if (disk_open)
     {
-        fclose(fp);
+        backend->close();
+        disk_open = 0;
     }
     return 0;
 }
 
+/*---------------------------------------------------------------*/
+/*Forces every block written so far to stable storage            */
+/*---------------------------------------------------------------*/
+int sync_disk()
+{
+    if (!disk_open)
+        return -1;
+    return backend->sync();
+}
+
 /*---------------------------------------*/
 /*Initializes a disk file filled with 0's*/
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    /*Request timing and failures come from the device model*/
+    get_disk_model();
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
     
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
 
-    if (fp == NULL)
+    /*Creates a new image*/
+    close_disk();
+    if (get_disk_backend()->open(filename, (long)block_size * num_blocks, 1) != 0)
     {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
-    {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
-    }
+    disk_open = 1;
+    trace_open();
     return 0;
 }
 /*----------------------------*/
@@ -66,12 +538,8 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    /*Request timing and failures come from the device model*/
+    get_disk_model();
 
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
@@ -79,14 +547,15 @@ int init_disk(char *filename, int block_size, int num_blocks)
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
-
-    if (fp == NULL)
+    /*Opens an image*/
+    close_disk();
+    if (get_disk_backend()->open(filename, (long)block_size * num_blocks, 0) != 0)
     {
         printf("Could not open %s\n\n", filename);
         return -1;
     }
+    disk_open = 1;
+    trace_open();
     return 0;
 }
 
@@ -95,46 +564,26 @@ int init_disk(char *filename, int block_size, int num_blocks)
 /*-------------------------------------------------------------------*/
 int read_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, j, e, s;
-    e = 0;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (!disk_open || start_address < 0 || start_address + nblocks > MAX_BLOCK)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
-
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-
-       for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-        }
-    }
-
-    free(blockRead);
+    /*Pause until the device model completes the request*/
+    if (model_active && model_request(start_address, nblocks) != 0)
+        return -1;
 
+    if (backend->read((long)start_address * BLOCK_SIZE, (long)nblocks * BLOCK_SIZE, buffer) != 0)
+        return -1;
+    __atomic_fetch_add(&stats.reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.blocks_read, nblocks, __ATOMIC_RELAXED);
+    thread_blocks += nblocks;
+    trace_request(TRACE_READ, start_address, nblocks);
 
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
+    /*Return the number of blocks read*/
+    return nblocks;
 }
 
 /*------------------------------------------------------------------*/
@@ -142,39 +591,68 @@ int read_blocks(int start_address, int nblocks, void *buffer)
 /*------------------------------------------------------------------*/
 int write_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, e, s;
-    e = 0;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (!disk_open || start_address < 0 || start_address + nblocks > MAX_BLOCK)
     {
         printf("out of bound error\n");
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*Pause until the device model completes the request*/
+    if (model_active && model_request(start_address, nblocks) != 0)
+        return -1;
 
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+    if (backend->write((long)start_address * BLOCK_SIZE, (long)nblocks * BLOCK_SIZE, buffer) != 0)
+        return -1;
+    __atomic_fetch_add(&stats.writes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.blocks_written, nblocks, __ATOMIC_RELAXED);
+    thread_blocks += nblocks;
+    trace_request(TRACE_WRITE, start_address, nblocks);
 
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+    /*Return the number of blocks written*/
+    return nblocks;
+}
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
-    }
-    free(blockWrite);
+/*------------------------------------------------------------------*/
+/*Returns the number of requests served and blocks moved since the  */
+/*last reset_disk_stats                                             */
+/*------------------------------------------------------------------*/
+DiskStats get_disk_stats()
+{
+    DiskStats result;
+    result.reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+    result.writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+    result.blocks_read = __atomic_load_n(&stats.blocks_read, __ATOMIC_RELAXED);
+    result.blocks_written = __atomic_load_n(&stats.blocks_written, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&model_lock);
+    result.retries = stats.retries;
+    result.failures = stats.failures;
+    result.service_us = stats.service_us;
+    pthread_mutex_unlock(&model_lock);
+    return result;
+}
 
-    /*If no failure return the number of blocks written, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
+/*------------------------------------------------------------------*/
+/*Sets the disk counters back to 0                                  */
+/*------------------------------------------------------------------*/
+void reset_disk_stats()
+{
+    __atomic_store_n(&stats.reads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.writes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.blocks_read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.blocks_written, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&model_lock);
+    stats.retries = 0;
+    stats.failures = 0;
+    stats.service_us = 0;
+    pthread_mutex_unlock(&model_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Returns the blocks read and written by the calling thread. Never  */
+/*reset, callers count the difference between two calls            */
+/*------------------------------------------------------------------*/
+long get_thread_disk_blocks()
+{
+    return thread_blocks;
 }
@@ -1,5 +1,78 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+#include <stdint.h>
+/*Storage behind the emulated disk. Offsets and lengths are in bytes and always cover whole blocks.
+ * Every function returns 0 on success and -1 on failure.*/
+typedef struct {
+    const char *name;
+    int (*open)(char *filename, long size, int fresh);//fresh != 0 creates a zero-filled image of size bytes
+    int (*read)(long offset, long length, void *buffer);
+    int (*write)(long offset, long length, void *buffer);
+    int (*sync)();
+    int (*close)();
+} DiskBackend;
+
+extern const DiskBackend FILE_DISK;//image file accessed with pread/pwrite
+extern const DiskBackend RAM_DISK;//image held in memory, kept across close_disk() until a fresh disk replaces it
+extern const DiskBackend MMAP_DISK;//image file mapped into memory
+
+/*Timing of the emulated device. A request costs request_us, plus kib_us per KiB transferred, plus seek_us_per_block
+ * for each block between its start and the end of the previous request (at most max_seek_us). Up to queue_depth
+ * requests are served at once, a request arriving while all are busy waits for the first to finish.
+ * Each attempt fails with probability failure_p and is retried up to max_retry times (each retry costs the full
+ * time again), after which the request fails. Callers are only delayed if wait != 0, the modeled time is counted
+ * in DiskStats either way.*/
+typedef struct {
+    const char *name;
+    double request_us;
+    double kib_us;
+    double seek_us_per_block;
+    double max_seek_us;
+    int queue_depth;//1 to MAX_QUEUE_DEPTH
+    double failure_p;
+    int max_retry;
+    int wait;
+} DiskModel;
+#define MAX_QUEUE_DEPTH 64
+
+extern const DiskModel NO_LATENCY;//requests take no time and never fail (default)
+extern const DiskModel HDD_MODEL;//a single-head hard drive, seeks dominate
+extern const DiskModel SSD_MODEL;//a flash drive serving 32 requests in parallel
+
+//requests served by read_blocks/write_blocks, the blocks they moved and their modeled time
+typedef struct {long reads; long writes; long blocks_read; long blocks_written; long retries; long failures;
+    double service_us;} DiskStats;
+
+int set_disk_backend(const DiskBackend *backend);
+const DiskBackend *get_disk_backend();
+/*Block I/O trace. The file starts with TRACE_MAGIC, followed by one TraceRecord per request in the order they
+ * completed. A TRACE_OPEN record is written each time a disk is opened, the requests after it use its geometry.*/
+#define TRACE_MAGIC "SFSTRC1\n"
+#define TRACE_READ 0
+#define TRACE_WRITE 1
+#define TRACE_OPEN 2
+#define TRACE_NO_ORIGIN 255
+typedef struct {
+    uint32_t delta_us;//time since the previous record
+    int32_t start;//first block (TRACE_OPEN: number of blocks)
+    int32_t nblocks;//number of blocks (TRACE_OPEN: block size)
+    uint8_t op;
+    uint8_t origin;//tag of the call that made the request (see set_disk_origin), TRACE_NO_ORIGIN if none
+    uint16_t unused;
+} TraceRecord;
+
+int set_disk_model(const DiskModel *model);
+const DiskModel *get_disk_model();
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int sync_disk();
 int close_disk();
+DiskStats get_disk_stats();//returns the disk counters
+void reset_disk_stats();//sets the disk counters back to 0
+long get_thread_disk_blocks();//blocks read and written by the calling thread so far (not reset)
+int start_disk_trace(const char *filename);//records every request to a trace file (also set by SFS_DISK_TRACE)
+int stop_disk_trace();
+void set_disk_origin(int origin);//tags the calling thread's next requests (0 to 254, -1 for none)
+#endif
@@ -4,185 +4,401 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <dirent.h>
 #include <errno.h>
-#include <sys/time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
-static int fuse_getattr(const char *path, struct stat *stbuf)
+/*
+ * FUSE frontend, mounts an SFS image:
+ *     SFS_Fuse [--image=NAME] [--format] [--block-size=N] [--blocks=N] [--files=N] [--inode-bytes=N] mountpoint
+ *              [FUSE options]
+ * The image (default "sfs") is mounted as it is, or formatted first with --format and the given geometry.
+ * FUSE runs the callbacks on several threads unless -s is given, the SFS calls are safe to make concurrently.
+ *
+ * SFS allows a file to be open only once, so every FUSE handle on a file shares one SFS descriptor, stored in
+ * fi->fh from open/create until the last release. Reads and writes on a descriptor are serialized, since they
+ * move its read/write pointer before transferring.
+ */
+
+#define MAX_FNAME_SIZE 20//longest file name SFS accepts
+#define MAX_IO_BYTES (1 << 20)//largest read or write request asked from the kernel
+#define ZERO_CHUNK_BYTES (64 << 10)//truncate extends a file by writing zeros in pieces of this size
+
+typedef struct OpenFile {
+    char name[MAX_FNAME_SIZE + 1];
+    int fd;//SFS descriptor
+    int handles;//FUSE handles sharing it
+    pthread_mutex_t lock;//held while seeking and transferring
+    struct OpenFile *next;
+} OpenFile;
+
+static char zeros[ZERO_CHUNK_BYTES];
+static OpenFile *open_files = NULL;
+//Guards open_files. readdir also holds it: SFS has a single directory cursor, and no file may be created or removed
+//while it goes around
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct sfs_options {
+    char *image;
+    int format;
+    int block_size;//geometry used by --format
+    int blocks;
+    int files;
+    int inode_bytes;//size of an inode record, files up to inode_bytes - 8 bytes are stored in it
+};
+static struct sfs_options options = {NULL, 0, 4096, 65536, 1024, SFS_DEFAULT_INODE_BYTES};
+
+/*Returns the SFS name of a path in the root directory, NULL if it isn't one*/
+static const char *sfs_name(const char *path)
+{
+    if (path[0] != '/' || strchr(path + 1, '/') != NULL || strlen(path + 1) > MAX_FNAME_SIZE)
+        return NULL;
+    return path + 1;
+}
+
+/*Returns the open file named name. files_lock must be held*/
+static OpenFile *open_find(const char *name)
+{
+    OpenFile *file;
+
+    for (file = open_files; file != NULL; file = file->next) {
+        if (strcmp(file->name, name) == 0)
+            return file;
+    }
+    return NULL;
+}
+
+/*Adds a FUSE handle to the file, opening (and creating) it in SFS if it isn't open yet.
+ * files_lock must be held. Returns 0 on success, -errno on failure*/
+static int open_handle(const char *name, struct fuse_file_info *fi)
+{
+    OpenFile *file = open_find(name);
+
+    if (file == NULL) {
+        file = malloc(sizeof(OpenFile));
+        if (file == NULL)
+            return -ENOMEM;
+        strcpy(file->name, name);
+        file->fd = sfs_fopen((char *)name);
+        if (file->fd < 0) {
+            free(file);
+            return -ENOSPC;
+        }
+        file->handles = 0;
+        pthread_mutex_init(&file->lock, NULL);
+        file->next = open_files;
+        open_files = file;
+    }
+    file->handles++;
+    fi->fh = (uint64_t)(uintptr_t)file;
+    return 0;
+}
+
+static OpenFile *handle_file(struct fuse_file_info *fi)
+{
+    return (OpenFile *)(uintptr_t)fi->fh;
+}
+
+static void *fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    (void)cfg;
+    conn->max_write = MAX_IO_BYTES;
+    conn->max_readahead = MAX_IO_BYTES;
+    return NULL;
+}
+
+static void fuse_destroy(void *private_data)
 {
-    int res = 0;
+    (void)private_data;
+    sfs_sync();
+}
+
+static int fuse_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+    const char *name = sfs_name(path);
     int size;
 
+    (void)fi;
     memset(stbuf, 0, sizeof(struct stat));
-
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-    } else if((size = sfs_GetFileSize(path)) != -1) {
-        stbuf->st_mode = S_IFREG | 0666;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = size;
-    } else
-        res = -ENOENT;
-
-    return res;
+        return 0;
+    }
+    if (name == NULL || (size = sfs_getfilesize(name)) < 0)
+        return -ENOENT;
+    stbuf->st_mode = S_IFREG | 0666;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = size;
+    stbuf->st_blocks = ((long)size + 511) / 512;
+    return 0;
 }
 
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-        off_t offset, struct fuse_file_info *fi)
+        off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
-    char file_name[MAXFILENAME];
+    char first[MAX_FNAME_SIZE + 1] = "";
+    char file_name[MAX_FNAME_SIZE + 1];
+    struct stat st;
 
+    (void)offset;
+    (void)fi;
+    (void)flags;
     if (strcmp(path, "/") != 0)
         return -ENOENT;
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-
-    while(sfs_get_next_filename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+
+    /*The cursor wraps around the directory, so the listing ends when the first name comes back.
+      Only the file type is given, the sizes are looked up by getattr when they are needed*/
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG;
+    pthread_mutex_lock(&files_lock);
+    while (sfs_getnextfilename(file_name) == 0) {
+        file_name[MAX_FNAME_SIZE] = '\0';
+        if (strcmp(file_name, first) == 0)
+            break;
+        if (first[0] == '\0')
+            strcpy(first, file_name);
+        if (filler(buf, file_name, &st, 0, 0) != 0)
+            break;
     }
-
+    pthread_mutex_unlock(&files_lock);
     return 0;
 }
 
 static int fuse_unlink(const char *path)
 {
+    const char *name = sfs_name(path);
     int res;
-    char filename[MAXFILENAME];
-
-    strcpy(filename, path);
-    res = sfs_remove(filename);
-    if (res == -1)
-        return -errno;
 
-    return 0;
+    if (name == NULL)
+        return -ENOENT;
+    pthread_mutex_lock(&files_lock);
+    if (open_find(name) != NULL)
+        res = -EBUSY;//SFS can't remove an open file
+    else
+        res = sfs_remove((char *)name) == 0 ? 0 : -ENOENT;
+    pthread_mutex_unlock(&files_lock);
+    return res;
 }
 
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
+    const char *name = sfs_name(path);
     int res;
-    char filename[MAXFILENAME];
 
-    strcpy(filename, path);
+    if (name == NULL)
+        return -ENOENT;
+    pthread_mutex_lock(&files_lock);
+    if (open_find(name) == NULL && sfs_getfilesize(name) < 0)
+        res = -ENOENT;//sfs_fopen would create it
+    else
+        res = open_handle(name, fi);
+    pthread_mutex_unlock(&files_lock);
+    return res;
+}
 
-    res = sfs_fopen(filename);
-    if (res == -1)
-        return -errno;
+static int fuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    const char *name = sfs_name(path);
+    int res;
 
-    sfs_fclose(res);
+    (void)mode;
+    if (name == NULL)
+        return path[0] == '/' && strchr(path + 1, '/') == NULL ? -ENAMETOOLONG : -ENOENT;
+    pthread_mutex_lock(&files_lock);
+    res = open_handle(name, fi);
+    pthread_mutex_unlock(&files_lock);
+    return res;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    OpenFile *file = handle_file(fi);
+    OpenFile **link;
+
+    (void)path;
+    pthread_mutex_lock(&files_lock);
+    if (--file->handles == 0) {
+        for (link = &open_files; *link != file; link = &(*link)->next)
+            ;
+        *link = file->next;
+        sfs_fclose(file->fd);
+        pthread_mutex_destroy(&file->lock);
+        free(file);
+    }
+    pthread_mutex_unlock(&files_lock);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
+    OpenFile *file = handle_file(fi);
     int res;
 
-    char filename[MAXFILENAME];
-
-    strcpy(filename, path);
-
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-
-    if(sfs_frseek(fd, offset) == -1)
-        return -errno;
-
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
-
-    sfs_fclose(fd);
-    return res;
+    (void)path;
+    if (offset > INT_MAX)
+        return 0;
+    if (size > INT_MAX)
+        size = INT_MAX;
+    pthread_mutex_lock(&file->lock);
+    sfs_frseek(file->fd, (int)offset);
+    res = sfs_fread(file->fd, buf, (int)size);
+    pthread_mutex_unlock(&file->lock);
+    return res < 0 ? -EIO : res;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
+    OpenFile *file = handle_file(fi);
     int res;
 
-    char filename[MAXFILENAME];
-
-    strcpy(filename, path);
-
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-
-    if(sfs_fwseek(fd, offset) == -1)
-        return -errno;
-
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
-        return -errno;
-
-    sfs_fclose(fd);
+    (void)path;
+    if (offset + (off_t)size > INT_MAX)
+        return -EFBIG;
+    pthread_mutex_lock(&file->lock);
+    sfs_fwseek(file->fd, (int)offset);
+    res = sfs_fwrite(file->fd, (char *)buf, (int)size);
+    pthread_mutex_unlock(&file->lock);
+    if (res < 0)
+        return -EIO;//the disk failed
+    if (res == 0 && size > 0)
+        return -ENOSPC;
     return res;
 }
 
-static int fuse_truncate(const char *path, off_t size)
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
-    char filename[MAXFILENAME];
-    int fd;
-
-    strcpy(filename, path);
-
-    fd = sfs_remove(filename);
-    if (fd == -1)
-        return -errno;
-
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
-    return 0;
+    (void)path;
+    (void)datasync;
+    return sfs_fsync(handle_file(fi)->fd) == 0 ? 0 : -EIO;
 }
 
-static int fuse_access(const char *path, int mask)
+/*SFS can't shrink a file: sizes can only grow (by writing zeros past the end), or drop to 0 by re-creating the
+ * file. An open file (an O_TRUNC open reaches here after its handle exists) is closed for that, then its shared
+ * descriptor is replaced by one on the new file*/
+static int fuse_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 {
-    return 0;
-}
+    const char *name = sfs_name(path);
+    OpenFile *file;
+    int current, res = 0, fd, pos, chunk;
 
-static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
-{
-    return 0;
+    (void)fi;
+    if (name == NULL || (current = sfs_getfilesize(name)) < 0)
+        return -ENOENT;
+    if (size == current)
+        return 0;
+    if (size > INT_MAX)
+        return -EFBIG;
+    pthread_mutex_lock(&files_lock);
+    file = open_find(name);
+    if (size == 0 && file == NULL) {
+        sfs_remove((char *)name);
+        fd = sfs_fopen((char *)name);
+        res = fd < 0 ? -EIO : 0;
+        sfs_fclose(fd);
+    } else if (size == 0) {
+        pthread_mutex_lock(&file->lock);
+        sfs_fclose(file->fd);//SFS can't remove an open file
+        sfs_remove((char *)name);
+        file->fd = sfs_fopen((char *)name);
+        res = file->fd < 0 ? -EIO : 0;
+        pthread_mutex_unlock(&file->lock);
+    } else if (size > current) {
+        fd = file != NULL ? file->fd : sfs_fopen((char *)name);
+        if (file != NULL)
+            pthread_mutex_lock(&file->lock);
+        sfs_fwseek(fd, current);
+        for (pos = current; pos < size && res == 0; pos += chunk) {
+            chunk = size - pos < ZERO_CHUNK_BYTES ? (int)(size - pos) : ZERO_CHUNK_BYTES;
+            if (sfs_fwrite(fd, zeros, chunk) != chunk)
+                res = -ENOSPC;
+        }
+        if (file != NULL)
+            pthread_mutex_unlock(&file->lock);
+        else
+            sfs_fclose(fd);
+    } else {
+        res = -EOPNOTSUPP;
+    }
+    pthread_mutex_unlock(&files_lock);
+    return res;
 }
 
-static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
+static int fuse_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
 {
-    char filename[MAXFILENAME];
-    int fd;
+    struct stat st;
 
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    /*SFS keeps no times, only check that the file exists*/
+    (void)tv;
+    return fuse_getattr(path, &st, fi);
+}
 
-    sfs_fclose(fd);
+static int fuse_access(const char *path, int mask)
+{
+    (void)path;
+    (void)mask;
     return 0;
 }
 
 static struct fuse_operations xmp_oper = {
+    .init = fuse_init,
+    .destroy = fuse_destroy,
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
-    .mknod = fuse_mknod,
     .unlink = fuse_unlink,
     .truncate = fuse_truncate,
     .open = fuse_open,
+    .create = fuse_create,
+    .release = fuse_release,
     .read = fuse_read,
     .write = fuse_write,
+    .fsync = fuse_fsync,
+    .utimens = fuse_utimens,
     .access = fuse_access,
-    .create = fuse_create,
+};
+
+static const struct fuse_opt option_spec[] = {
+    {"--image=%s", offsetof(struct sfs_options, image), 0},
+    {"--format", offsetof(struct sfs_options, format), 1},
+    {"--block-size=%d", offsetof(struct sfs_options, block_size), 0},
+    {"--blocks=%d", offsetof(struct sfs_options, blocks), 0},
+    {"--files=%d", offsetof(struct sfs_options, files), 0},
+    {"--inode-bytes=%d", offsetof(struct sfs_options, inode_bytes), 0},
+    FUSE_OPT_END
 };
 
 int main(int argc, char *argv[])
 {
-    mksfs(1);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int res;
 
-    return fuse_main(argc, argv, &xmp_oper, NULL);
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return 1;
+    if (options.image != NULL)
+        sfs_setdisk(options.image);
+    if (options.format) {
+        if (sfs_format(options.block_size, options.blocks, options.files, options.inode_bytes) < 0) {
+            fprintf(stderr, "Could not format the image\n");
+            return 1;
+        }
+    } else if (mksfs(0) < 0) {
+        fprintf(stderr, "Could not mount the image %s\n", options.image != NULL ? options.image : "sfs");
+        return 1;
+    }
+
+    res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    fuse_opt_free_args(&args);
+    return res;
 }
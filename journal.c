@@ -0,0 +1,203 @@
+/*
+ * Metadata Journal
+ *
+ * Write-ahead log for the metadata blocks of sfs_api.c. Metadata blocks written to the block cache are added to the
+ * running transaction, which holds them in the cache until it commits. A commit first writes back every other dirty
+ * block (so committed metadata never points at stale data), then writes the transaction to the journal region as
+ * [DESCRIPTOR|BLOCK 1|...|BLOCK n|COMMIT] with one request, then writes the blocks to their home locations
+ * (checkpoint) and finally retires the transaction. Many calls share one commit.
+ *
+ * DESCRIPTOR: [JOURNAL_MAGIC|sequence|n|home address of block 1|...|home address of block n]
+ * COMMIT: [COMMIT_MAGIC|sequence|n|checksum of the descriptor and logged blocks]
+ * A retired journal holds a descriptor with n = 0. A transaction whose commit record doesn't match is ignored.
+ * journal_add, journal_pending, journal_capacity and journal_commit take journalLock and may be called by several
+ * threads. sfs_api.c keeps other threads from changing metadata while it commits (see txnLock there).
+ */
+
+#include "journal.h"
+
+#include "block_cache.h"
+#include "disk_emu.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JOURNAL_MAGIC 0x4A524E4C//"JRNL"
+#define COMMIT_MAGIC 0x434D4954//"CMIT"
+#define HEADER_INTS 3//ints before the block addresses in the descriptor
+
+static int journalStart = 0;//block address of the descriptor
+static int journalBlks = 0;//size of the journal region, 0 if journaling is disabled
+static int blockBytes = 0;
+static int capacity = 0;//maximum blocks per transaction
+static unsigned int sequence = 0;//sequence number of the running transaction
+static int *txnBlocks = NULL;//home addresses of the blocks in the running transaction
+static int txnCount = 0;
+static char *logBuff = NULL;//staging buffer for a whole transaction (descriptor, blocks and commit record)
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;//guards the running transaction
+
+/*FNV-1a hash of length bytes.*/
+static unsigned int checksum(const char *data, long length) {
+  unsigned int hash = 2166136261u;
+  for (long i = 0; i < length; ++i) {
+    hash ^= (unsigned char) data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*Marks the journal empty by writing a descriptor with no blocks.*/
+static int journal_retire() {
+  int *descriptor = (int *) logBuff;
+  memset(logBuff, 0, blockBytes);
+  descriptor[0] = JOURNAL_MAGIC;
+  descriptor[1] = (int) sequence;
+  if (write_blocks(journalStart, 1, logBuff) < 0) return -1;
+  return sync_disk();
+}
+
+/*Copies the blocks of a committed transaction found in the journal to their home locations.*/
+static int journal_replay() {
+  int *descriptor = (int *) logBuff;
+  if (read_blocks(journalStart, 1, logBuff) < 0) return -1;
+  if (descriptor[0] != JOURNAL_MAGIC) {//never used
+    sequence = 1;
+    return journal_retire();
+  }
+  sequence = (unsigned int) descriptor[1] + 1;
+  int count = descriptor[2];
+  if (count <= 0 || count > capacity) return 0;//retired
+  if (read_blocks(journalStart + 1, count + 1, logBuff + blockBytes) < 0) return -1;
+  int *commit = (int *) (logBuff + (long) (count + 1) * blockBytes);
+  if (commit[0] != COMMIT_MAGIC || commit[1] != descriptor[1] || commit[2] != count
+      || (unsigned int) commit[3] != checksum(logBuff, (long) (count + 1) * blockBytes))
+    return journal_retire();//torn transaction, it never committed
+  for (int i = 0; i < count; ++i) {
+    if (write_blocks(descriptor[HEADER_INTS + i], 1, logBuff + (long) (i + 1) * blockBytes) < 0) return -1;
+  }
+  if (sync_disk() < 0) return -1;
+  return journal_retire();
+}
+
+int journal_init(int start, int nblocks, int blockSize) {
+  journal_close();
+  if (nblocks < 3) return 0;//too small to hold a transaction, journaling stays disabled
+  journalStart = start;
+  journalBlks = nblocks;
+  blockBytes = blockSize;
+  capacity = nblocks - 2;//minus the descriptor and commit record
+  if (capacity > blockSize / (int) sizeof(int) - HEADER_INTS)//the descriptor must hold every address
+    capacity = blockSize / (int) sizeof(int) - HEADER_INTS;
+  txnBlocks = malloc(sizeof(int) * capacity);
+  logBuff = malloc((size_t) (capacity + 2) * blockSize);
+  if (txnBlocks == NULL || logBuff == NULL) {
+    journal_close();
+    return -1;
+  }
+  txnCount = 0;
+  return journal_replay();
+}
+
+void journal_close() {
+  for (int i = 0; i < txnCount; ++i)
+    cache_release(txnBlocks[i]);
+  free(txnBlocks);
+  free(logBuff);
+  txnBlocks = NULL;
+  logBuff = NULL;
+  txnCount = 0;
+  journalBlks = 0;
+  capacity = 0;
+}
+
+/*Returns the maximum number of blocks in a transaction.*/
+static int txn_capacity() {
+  //held blocks can't be evicted, so a transaction may only fill half of the block cache
+  int cacheLimit = cache_getCapacity() / 2;
+  return capacity < cacheLimit ? capacity : cacheLimit;
+}
+
+int journal_add(int blockNum) {
+  pthread_mutex_lock(&journalLock);
+  int result = 0;
+  int held = journalBlks == 0 ? 0 : cache_hold(blockNum);
+  if (held < 0) {
+    result = -1;
+  } else if (held > 0) {//not yet part of the transaction
+    if (txnCount == txn_capacity()) {
+      cache_release(blockNum);
+      result = -1;
+    } else {
+      txnBlocks[txnCount++] = blockNum;
+    }
+  }
+  pthread_mutex_unlock(&journalLock);
+  return result;
+}
+
+int journal_pending() {
+  pthread_mutex_lock(&journalLock);
+  int result = txnCount;
+  pthread_mutex_unlock(&journalLock);
+  return result;
+}
+
+int journal_capacity() {
+  pthread_mutex_lock(&journalLock);
+  int result = txn_capacity();
+  pthread_mutex_unlock(&journalLock);
+  return result;
+}
+
+static int compareInt(const void *a, const void *b) {
+  return *(const int *) a - *(const int *) b;
+}
+
+/*Does the work of journal_commit, journalLock must be held.*/
+static int txn_commit() {
+  if (journalBlks == 0 || txnCount == 0)
+    return cache_sync();
+  //ordered data: the blocks the transaction's metadata points at reach the disk first
+  if (cache_sync() < 0 || sync_disk() < 0) return -1;
+  //log the transaction with a single request
+  int *descriptor = (int *) logBuff;
+  memset(logBuff, 0, blockBytes);
+  descriptor[0] = JOURNAL_MAGIC;
+  descriptor[1] = (int) sequence;
+  descriptor[2] = txnCount;
+  memcpy(descriptor + HEADER_INTS, txnBlocks, sizeof(int) * txnCount);
+  for (int i = 0; i < txnCount; ++i) {
+    if (cache_read(txnBlocks[i], 1, logBuff + (long) (i + 1) * blockBytes) < 0) return -1;
+  }
+  int *commit = (int *) (logBuff + (long) (txnCount + 1) * blockBytes);
+  memset(commit, 0, blockBytes);
+  commit[0] = COMMIT_MAGIC;
+  commit[1] = (int) sequence;
+  commit[2] = txnCount;
+  commit[3] = (int) checksum(logBuff, (long) (txnCount + 1) * blockBytes);
+  if (write_blocks(journalStart, txnCount + 2, logBuff) < 0 || sync_disk() < 0) return -1;
+  //checkpoint, in disk order so consecutive blocks go out together. If this fails, mksfs(0) replays the journal
+  qsort(txnBlocks, txnCount, sizeof(int), compareInt);
+  int result = 0;
+  for (int i = 0; i < txnCount; ++i)
+    cache_release(txnBlocks[i]);
+  for (int i = 0; i < txnCount; ) {
+    int run = 1;
+    while (i + run < txnCount && txnBlocks[i + run] == txnBlocks[i] + run)
+      run++;
+    if (cache_syncRange(txnBlocks[i], run) < 0)
+      result = -1;
+    i += run;
+  }
+  txnCount = 0;
+  sequence++;
+  if (result < 0 || sync_disk() < 0) return -1;
+  return journal_retire();
+}
+
+int journal_commit() {
+  pthread_mutex_lock(&journalLock);
+  int result = txn_commit();
+  pthread_mutex_unlock(&journalLock);
+  return result;
+}
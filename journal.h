@@ -0,0 +1,9 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+int journal_init(int start, int nblocks, int blockBytes); // attaches to the journal region and replays a committed transaction left in it. nblocks 0 disables journaling
+void journal_close(); // releases the journal, the running transaction must have been committed
+int journal_add(int blockNum); // logs a cached metadata block in the running transaction. Returns -1 if the transaction is full
+int journal_pending(); // number of blocks in the running transaction
+int journal_capacity(); // maximum number of blocks in a transaction, 0 if journaling is disabled
+int journal_commit(); // writes back the data blocks, then commits and checkpoints the running transaction
+#endif
@@ -3,53 +3,152 @@
  *
  * Author: Julian Armour
  *
- * disk size: 256KiB (256 blocks)
+ * The geometry (block size, block count, number of files, inode record size) is chosen by sfs_format and read back
+ * from the super block on mount. mksfs(1) formats the default geometry:
+ * disk size: 256KiB (256 blocks of 1KiB)
  * max file size: 268 KiB (limited by disk size of course)
  * max number of files: 256
- * DISK STRUCTURE: [SUPER(1 block)|INODE-TBL(1)|FREE-BITMAP(1)|DATA-BLOCKS(253)]
- * INODE STRUCTURE: [mode|size|pointer1|...|pointer12|ind-pointer]
+ * inode record size: 128 bytes (files of up to 120 bytes are stored inline)
+ * DISK STRUCTURE: [SUPER(1 block)|INODE-TBL(n)|FREE-BITMAP(m)|DATA-BLOCKS|JOURNAL]
+ * SUPER BLOCK: [block bytes|block count|n|m|root dir inode|journal address|journal blocks|max files|inode bytes]
+ * INODE-TBL: max files inodes packed back to back, each in a record of inode bytes (a free inode has mode 0)
+ * INODE STRUCTURE: [mode|size|pointer1|...|pointer12|ind-pointer|double-ind-pointer|triple-ind-pointer]
+ * INLINE INODE STRUCTURE: [mode|size|file data (up to inode bytes - 8)] (small files, MODE_INLINE is set)
+ *
+ * THREADS: the file calls may be made by several threads at once (see "Locks" below). Mounting, formatting and the
+ * sfs_set* calls must not run concurrently with anything else. A file descriptor is used by one thread at a time.
  */
 
 #include "sfs_api.h"
 
+#include "async_io.h"
+#include "block_cache.h"
 #include "disk_emu.h"
+#include "journal.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define MAX_FNAME_SIZE 20//maximum length of a file name (including 'period' and 'file extension'
-#define BLOCK_BYTES 1024//size in bytes of a block
-#define BLOCK_COUNT 256//number of disk blocks
-#define INODE_BLKS 1//number of "inode table" blocks
+#define DEFAULT_BLOCK_BYTES 1024//geometry formatted by mksfs(1)
+#define DEFAULT_BLOCK_COUNT 256
+#define DEFAULT_MAX_FILES 256
 #define INODE_BLK 1//the Inode Table's block address
-#define FREE_BM_BLKS 1//number of "free bitmap" blocks
-#define FREE_BM_BLK 2//the free block bitmap's block address
 #define ROOT_DIR_INODE 0//the inode id (index in the inode tbl) for the root directory
-#define MAX_FILES 256//maximum number of files sfs can create (including root)
-#define MAX_FILE_SIZE 274432//inode can hold 268 data blocks (1024*268 = 274,432)
 #define DIR_ENTRY_BYTES 24//filename_bytes(20) + int_bytes(4)
-#define FREE_MAP_CHUNKS 8//size of int[] needed to hold BLOCK_COUNT bits
+#define MAX_IO_BLKS 64//maximum number of blocks the data path maps and transfers at a time
+#define INODE_POINTERS 15//12 direct pointers, then the single, double and triple indirect pointers
+#define MIN_INODE_BYTES ((2 + INODE_POINTERS) * (int) sizeof(int))//an inode record holds at least mode, size and pointers
+#define MAX_JOURNAL_BYTES (4 * 1024 * 1024)//upper bound on the size of the journal region sfs_format creates
+#define STEP_PATH_BLKS 6//indirect blocks a step changes: those on the paths of its first and last file block
+#define RA_MIN_BLKS 4//readahead window used when a file descriptor starts reading sequentially
 
 //File modes.
 static const int MODE_DIR = 1;//Directory file mode
 static const int MODE_BASIC = 2;//Basic file mode
+static const int MODE_INLINE = 4;//flag added to the mode of a file whose data is stored in its inode record
+
+//a file descriptor. raLast, raWindow and raEnd track sequential reads for readahead (see file_readahead)
+typedef struct {int inodeID; int read; int write; int raLast; int raWindow; int raEnd;} FD;
+typedef struct {int mode; int size; int pointers[INODE_POINTERS];} Inode;
+//an inode cache entry. Pinned entries (pins > 0) are referenced by an open file and are never evicted.
+//map[] caches the disk addresses of file blocks [mapFirst, mapFirst + mapCount), the last window walked
+typedef struct {int inodeID; int pins; char dirty; char ref; Inode inode; int mapFirst; int mapCount; int map[MAX_IO_BLKS];} CachedInode;
+//Indirect blocks loaded while walking an inode's pointers, one per depth below the inode
+//(a single, double or triple indirect pointer leads through 1, 2 or 3 of them)
+typedef struct {int blockNum[3]; char dirty[3]; int *entries[3];} IndirectPath;
+
+static char diskImage[256] = "sfs";//name of the disk image opened by mksfs
+static int mounted = 0;//1 while a disk is mounted, every file call fails until one is
 
-typedef struct {int inodeID; int read; int write;} FD;//a file descriptor
-typedef struct {int mode; int size; int pointers[13];} Inode;
+/*Geometry of the mounted disk, read from its super block*/
+static int blockBytes = 0;//size in bytes of a block, 0 while no disk is mounted
+static int blockCount = 0;//number of disk blocks
+static int maxFiles = 0;//maximum number of files sfs can create (including root)
+static int inodeTblBlks = 0;//number of "inode table" blocks
+static int inodeBytes = 0;//size of an inode record
+static int inodesPerBlk = 0;//inode records in an inode table block
+static int inlineBytes = 0;//largest file stored in its inode record
+static int freeMapBlk = 0;//the free block bitmap's block address
+static int freeMapBlks = 0;//number of "free bitmap" blocks
+static int freeMapChunks = 0;//size of int[] needed to hold blockCount bits
+static int dirBlks = 0;//blocks of the root directory file
+static int dirBytes = 0;//size of the root directory file
+static int maxFileSize = 0;//see maxFileBytes
+static unsigned int dirHashMask = 0;//number of buckets in the directory's name index - 1 (a power of 2 >= maxFiles)
+static char *zeroBlock = NULL;//a block of 0's
 
-/*In-memory data structures*/
-static int inodeTbl[MAX_FILES];//Inode Table cache (holds up to 256 inodes)
-//Directory cache. (holds up to 256 files)
+/*In-memory data structures, sized by the geometry when a disk is mounted*/
+static char *inodeUsed = NULL;//1 for each inode ID in use
+//Directory cache. (holds up to maxFiles files)
 //an entry in the directory is in format [filename|inodeId]
-static char dir[MAX_FILES][DIR_ENTRY_BYTES];
+static char (*dir)[DIR_ENTRY_BYTES] = NULL;
 static int dir_ptr = 0;
-//Open File Descriptor Table (holds up to 256 open files)
-static FD oft[MAX_FILES];
+//Directory name index. Maps a file name to its directory entry through chained hash buckets
+static int *dirHashHead = NULL;//first entry in each bucket, -1 if empty
+static int *dirHashNext = NULL;//next entry in the same bucket, -1 ends the chain
+//Unused directory entries, one set bit per free entry (bit i % 32 of word i / 32), the lowest is found with ctz
+static unsigned int *dirFreeMap = NULL;
+static int dirFreeCount = 0;
+static int dirFreeChunk = 0;//no word of dirFreeMap before this one has a set bit
+//Open File Descriptor Table (holds up to maxFiles open files)
+static FD *oft = NULL;
 //Free Block Bitmap
-static unsigned int freeMap[FREE_MAP_CHUNKS];
+static unsigned int *freeMap = NULL;
+static int freeBlkCount = 0;//number of 0 bits in freeMap
+//Blocks freed by the running journal transaction. They stay marked used in freeMap, so they aren't handed out again
+//before the metadata that frees them commits, and are released once it has (see metadata_commit)
+static unsigned int *freeMapPending = NULL;
+static int freePendingCount = 0;
+static int freeMapCursor = 0;//chunk of freeMap where the next allocation search starts
+static int allocMode = SFS_ALLOC_EXTENT;//block placement policy, see sfs_setallocmode
+//Metadata write-back. Changes to the inode table, directory and free bitmap only set these flags, the structures
+//are written out together by metadata_flush (on sfs_sync/sfs_fsync, or after every call in SFS_FLUSH_SYNC mode)
+static int flushMode = SFS_FLUSH_DEFERRED;
+static char *freeMapBlkDirty = NULL;//1 for each block of the free bitmap holding a changed bit
+static char *dirBlockDirty = NULL;//1 for each block of the root directory file holding a changed entry
+//Inode cache, decoded inodes are kept here and only written to disk when dirty. It has one slot per inode,
+//at least one per OFT entry so every open file can be pinned
+static CachedInode *inodeCache = NULL;
+static int *inodeCacheSlot = NULL;//slot in inodeCache holding each inode ID, -1 if not cached
+static int inodeCacheHand = 0;//CLOCK hand used to pick an eviction victim
+static int inodeDirtyCount = 0;//number of dirty cached inodes
+//Locks. A call takes them in this order: dirLock, the inode lock of its file, then txnLock. allocLock,
+//inodeCacheLock and reserveLock are only held while calling into the journal and block cache, which have their own.
+static pthread_rwlock_t dirLock = PTHREAD_RWLOCK_INITIALIZER;//directory, its name index, dir_ptr, oft slots, inodeUsed
+static pthread_mutex_t *inodeLocks = NULL;//one per inode, serializes the data I/O of a file (and its descriptor)
+static pthread_rwlock_t txnLock = PTHREAD_RWLOCK_INITIALIZER;//shared by calls changing metadata, exclusive to commit
+static pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;//free bitmap and allocation cursor
+static pthread_mutex_t inodeCacheLock = PTHREAD_MUTEX_INITIALIZER;//inode cache and the records in inode table blocks
+static pthread_mutex_t reserveLock = PTHREAD_MUTEX_INITIALIZER;//txnReserved
+static int txnReserved = 0;//journal blocks the metadata pending since the last exact count may take, see txn_begin
+static int stepJournalBlks = 0;//most metadata blocks one step of a call can add to a transaction, see geometry_set
+//Counters reported by sfs_stats. They are updated with relaxed atomic adds (see stat_add), so no lock is needed
+static SfsStats stats;
 
 //necessary function declarations
-static Inode fetchInode(int inodeId);
-static void flushInode(int inodeID, Inode inode);
+static Inode *inode_get(int inodeID);
+static Inode *inode_pin(int inodeID);
 static int allocBlk();
+static int allocBlks(int count, int *blockNums, int goal);
+static int freeMap_flush();
+static void freeMap_markDirty(int blockNum);
+static void freeMap_release(int blockNum);
+static void freeMap_flipPending();
+static void freeMap_releasePending();
+static int freeMap_hasPending();
+static void metadata_sync();
+static int file_read(int fileID, char *buf, int length);
+static int file_write(int fileID, const char *buf, int length);
+static int file_writeSteps(int fileID, const char *buf, int length);
+static int inode_promote(int inodeID, Inode *inode);
+static int file_allocate(int fileID, int offset, int length);
+static int file_sync(int fileID);
+static int file_remove(char *file);
+static int meta_write(int blockNum, int nblocks, const void *buf);
+static void flushIfSync();
 
 /*Not depending on the math lib in case a bash file auto-grader is being used*/
 static int min(int x, int y) {
@@ -57,37 +156,135 @@ static int min(int x, int y) {
   else return y;
 }
 
+/*Adds n to one of the counters in stats.*/
+static void stat_add(long *counter, long n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/*Counts a call to an API function and tags the disk requests it makes in the block I/O trace. Returns the number
+ * of disk blocks the calling thread moved so far, to be passed to stat_callEnd.*/
+static long stat_callBegin(int call) {
+  stat_add(&stats.calls[call], 1);
+  set_disk_origin(call);
+  return get_thread_disk_blocks();
+}
+
+/*Adds the disk blocks the calling thread moved since stat_callBegin to the call's count. Must be called on every
+ * path out of the call, so that later requests aren't tagged with it.*/
+static void stat_callEnd(int call, long blocksBefore) {
+  set_disk_origin(-1);
+  long moved = get_thread_disk_blocks() - blocksBefore;
+  if (moved > 0)
+    stat_add(&stats.callBlocks[call], moved);
+}
+
+/*Returns the counters gathered since the last sfs_resetstats, along with those of the block cache and disk.*/
+SfsStats sfs_stats() {
+  SfsStats result;
+  long *from = (long *) &stats, *to = (long *) &result;
+  for (size_t i = 0; i < sizeof(SfsStats) / sizeof(long); ++i)
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  DiskStats disk = get_disk_stats();
+  result.diskReads = disk.reads;
+  result.diskWrites = disk.writes;
+  result.blocksRead = disk.blocks_read;
+  result.blocksWritten = disk.blocks_written;
+  CacheStats cache = cache_getStats();
+  result.cacheHits = cache.hits;
+  result.cacheMisses = cache.misses;
+  return result;
+}
+
+/*Sets every counter reported by sfs_stats back to 0.*/
+void sfs_resetstats() {
+  long *counters = (long *) &stats;
+  for (size_t i = 0; i < sizeof(SfsStats) / sizeof(long); ++i)
+    __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+  reset_disk_stats();
+  cache_resetStats();
+}
+
 /*Places the name of the next file in the directory in fname. Returns 0 on success, -1 on failure*/
 int sfs_getnextfilename(char *fname) {
+  if (!mounted) return -1;
+  long blocks = stat_callBegin(SFS_CALL_GETNEXTFILENAME);
+  int result = -1;
+  pthread_rwlock_wrlock(&dirLock);//moves dir_ptr
   //check, starting at dir_ptr, each entry in the directory table for a valid file name
-  for (int entriesChecked = 0; entriesChecked < MAX_FILES; ++entriesChecked) {
+  for (int entriesChecked = 0; entriesChecked < maxFiles; ++entriesChecked) {
     char *entry = dir[dir_ptr];
-    dir_ptr = (dir_ptr + 1) % MAX_FILES;
+    dir_ptr = (dir_ptr + 1) % maxFiles;
     if (entry[0] != '\0') {
       memcpy(fname, entry, MAX_FNAME_SIZE);
-      return 0;
+      result = 0;
+      break;
     }
   }
-  return -1;
+  pthread_rwlock_unlock(&dirLock);
+  stat_callEnd(SFS_CALL_GETNEXTFILENAME, blocks);
+  return result;
+}
+
+/*FNV-1a hash of a file name (at most MAX_FNAME_SIZE characters), reduced to a bucket of the directory index.*/
+static int dir_hash(const char *fname) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < MAX_FNAME_SIZE && fname[i] != '\0'; ++i) {
+    hash ^= (unsigned char) fname[i];
+    hash *= 16777619u;
+  }
+  return (int) (hash & dirHashMask);
 }
 
 /*Searches for a file with the name fname in the directory. If found, return's it's index, else returns -1.*/
 static int dir_find(const char *fname) {
-  //check each entry in the directory
-  for (int dirIndex = 0; dirIndex < MAX_FILES; ++dirIndex) {
-    if (memcmp(fname, dir[dirIndex], MAX_FNAME_SIZE) == 0)
+  stat_add(&stats.dirLookups, 1);
+  //only the entries whose name hashes to the same bucket need to be compared
+  for (int dirIndex = dirHashHead[dir_hash(fname)]; dirIndex != -1; dirIndex = dirHashNext[dirIndex]) {
+    if (strncmp(fname, dir[dirIndex], MAX_FNAME_SIZE) == 0)
       return dirIndex;
   }
   return -1;
 }
 
-/*Searches for a free entry in the dir cache and returns its index. returns -1 on failure.*/
+/*Returns the index of a free entry in the dir cache, the lowest one if several are free. returns -1 on failure.*/
 static int dir_findFree() {
-  for (int dirEntry = 0; dirEntry < MAX_FILES; ++dirEntry) {
-    if (dir[dirEntry][0] == '\0')// '\0' as the first character denotes an unused entry
-      return dirEntry;
-  }
-  return -1;
+  if (dirFreeCount == 0) return -1;
+  while (dirFreeMap[dirFreeChunk] == 0)
+    dirFreeChunk++;
+  return dirFreeChunk * 32 + __builtin_ctz(dirFreeMap[dirFreeChunk]);
+}
+
+/*Records that an entry changed, so that dir_flush rewrites the directory block(s) holding it.*/
+static void dir_markDirty(int dirIndex) {
+  dirBlockDirty[dirIndex * DIR_ENTRY_BYTES / blockBytes] = 1;
+  dirBlockDirty[(dirIndex * DIR_ENTRY_BYTES + DIR_ENTRY_BYTES - 1) / blockBytes] = 1;//entries can straddle blocks
+}
+
+/*Fills the free entry returned by dir_findFree and adds it to the name index.*/
+static void dir_add(int dirIndex, const char *fname, int inodeID) {
+  memset(dir[dirIndex], 0, DIR_ENTRY_BYTES);
+  strncpy(dir[dirIndex], fname, MAX_FNAME_SIZE);
+  memcpy(&dir[dirIndex][MAX_FNAME_SIZE], &inodeID, sizeof(int));
+  dir_markDirty(dirIndex);
+  dirFreeMap[dirIndex / 32] &= ~(1u << (dirIndex % 32));
+  dirFreeCount--;
+  int bucket = dir_hash(fname);
+  dirHashNext[dirIndex] = dirHashHead[bucket];
+  dirHashHead[bucket] = dirIndex;
+}
+
+/*Clears a used entry, removing it from the name index and marking it free.*/
+static void dir_delete(int dirIndex) {
+  int *link = &dirHashHead[dir_hash(dir[dirIndex])];
+  while (*link != dirIndex)
+    link = &dirHashNext[*link];
+  *link = dirHashNext[dirIndex];
+  memset(dir[dirIndex], 0, DIR_ENTRY_BYTES);
+  dir_markDirty(dirIndex);
+  dirFreeMap[dirIndex / 32] |= 1u << (dirIndex % 32);
+  dirFreeCount++;
+  if (dirIndex / 32 < dirFreeChunk)
+    dirFreeChunk = dirIndex / 32;
 }
 
 /*returns the inode ID from the entry at dirIndex in the root directory.*/
@@ -99,9 +296,8 @@ static int inodeID_from_dirIndex(int dirIndex) {
 
 /*returns the index of a free slot in oft (Open File Table). Returns -1 if all slots are taken.*/
 static int oft_findFree() {
-  for (int entry = 0; entry < MAX_FILES; ++entry) {
-    FD fd = oft[entry];
-    if (fd.inodeID == -1)//this fd entry is unused
+  for (int entry = 0; entry < maxFiles; ++entry) {
+    if (oft[entry].inodeID == -1)//this fd entry is unused
       return entry;
   }
   return -1;
@@ -109,7 +305,7 @@ static int oft_findFree() {
 
 /*returns the index in the oft that has the inode with id = inodeID. returns -1 if not found.*/
 static int oft_find(int inodeID) {
-  for (int entry = 0; entry < MAX_FILES; ++entry) {
+  for (int entry = 0; entry < maxFiles; ++entry) {
     if (oft[entry].inodeID == inodeID)
       return entry;
   }
@@ -118,21 +314,389 @@ static int oft_find(int inodeID) {
 
 /*Finds and returns the ID of a free inode in the inode table. -1 on failure.*/
 static int inodeTbl_findFree() {
-  for (int inodeID = 0; inodeID < MAX_FILES; ++inodeID) {
-    if (inodeTbl[inodeID] <= 0)// (-inf,0] means free
+  for (int inodeID = 0; inodeID < maxFiles; ++inodeID) {
+    if (!inodeUsed[inodeID])
       return inodeID;
   }
   return -1;
 }
 
+/*Returns the address of the inode table block holding inode inodeID.*/
+static int inode_block(int inodeID) {
+  return INODE_BLK + inodeID / inodesPerBlk;
+}
+
+/*Returns where the record of inode inodeID starts in the inode table block holding it.*/
+static char *inode_record(int inodeID, const char *tblBlock) {
+  return (char *) tblBlock + (inodeID % inodesPerBlk) * inodeBytes;
+}
+
+/*Returns where an inline file's data starts in the inode table block holding it.*/
+static char *inode_inlineData(int inodeID, const char *tblBlock) {
+  return inode_record(inodeID, tblBlock) + 2 * sizeof(int);
+}
+
+/*Encodes an inode into its record, the inode table block holding inodeID.
+ * The data of an inline file is left as it is, it is written by file_writeInline.*/
+static void inode_encode(const Inode *inode, int inodeID, char *tblBlock) {
+  int *record = (int *) inode_record(inodeID, tblBlock);
+  if (!(inode->mode & MODE_INLINE)) {
+    memset(record, 0, inodeBytes);//the rest of an inode record is unused
+    for (int i = 0; i < INODE_POINTERS; ++i) {
+      record[i+2] = inode->pointers[i];
+    }
+  }
+  record[0] = inode->mode;
+  record[1] = inode->size;
+}
+
+/*Decodes the record of inode inodeID from the inode table block holding it.
+ * An inline file has no block pointers, they are all set to 0.*/
+static void inode_decode(Inode *inode, int inodeID, const char *tblBlock) {
+  const int *record = (const int *) inode_record(inodeID, tblBlock);
+  inode->mode = record[0];
+  inode->size = record[1];
+  for (int i = 0; i < INODE_POINTERS; ++i) {
+    inode->pointers[i] = (inode->mode & MODE_INLINE) ? 0 : record[i+2];
+  }
+}
+
+/*Writes a cached inode into its record in the inode table. Returns 0 on success, -1 on failure (it stays dirty).*/
+static int inode_writeBack(CachedInode *entry) {
+  char tblBlock[blockBytes];
+  if (cache_read(inode_block(entry->inodeID), 1, tblBlock) < 0) return -1;
+  inode_encode(&entry->inode, entry->inodeID, tblBlock);
+  if (meta_write(inode_block(entry->inodeID), 1, tblBlock) < 0) return -1;
+  if (entry->dirty)
+    inodeDirtyCount--;
+  entry->dirty = 0;
+  return 0;
+}
+
+/*Empties the inode cache without writing anything back.*/
+static void inodeCache_init() {
+  for (int slot = 0; slot < maxFiles; ++slot) {
+    inodeCache[slot].inodeID = -1;
+    inodeCache[slot].pins = 0;
+    inodeCache[slot].dirty = 0;
+  }
+  for (int inodeID = 0; inodeID < maxFiles; ++inodeID) {
+    inodeCacheSlot[inodeID] = -1;
+  }
+  inodeCacheHand = 0;
+  inodeDirtyCount = 0;
+}
+
+/*Writes every dirty cached inode to its inode block. Returns 0 on success, -1 if one could not be written.*/
+static int inodeCache_sync() {
+  int result = 0;
+  pthread_mutex_lock(&inodeCacheLock);
+  for (int slot = 0; slot < maxFiles; ++slot) {
+    if (inodeCache[slot].inodeID >= 0 && inodeCache[slot].dirty && inode_writeBack(&inodeCache[slot]) < 0)
+      result = -1;
+  }
+  pthread_mutex_unlock(&inodeCacheLock);
+  return result;
+}
+
+/*Returns an unused inode cache slot, evicting an unpinned inode if needed. Returns -1 if every inode is pinned.*/
+static int inodeCache_victim() {
+  //an unpinned entry is found within two sweeps of the clock hand if there is one
+  for (int checked = 0; checked < 2 * maxFiles; ++checked) {
+    int slot = inodeCacheHand;
+    CachedInode *entry = &inodeCache[slot];
+    inodeCacheHand = (inodeCacheHand + 1) % maxFiles;
+    if (entry->inodeID < 0) return slot;//unused
+    if (entry->pins > 0) continue;
+    if (entry->ref) {//recently used, give it a second chance
+      entry->ref = 0;
+      continue;
+    }
+    if (entry->dirty && inode_writeBack(entry) < 0) continue;//keep it cached until it can be written
+    inodeCacheSlot[entry->inodeID] = -1;
+    entry->inodeID = -1;
+    return slot;
+  }
+  return -1;
+}
+
+/*Places inode inodeID in a free cache slot and returns the entry, or NULL if every inode is pinned.*/
+static CachedInode *inodeCache_insert(int inodeID) {
+  int slot = inodeCache_victim();
+  if (slot < 0) return NULL;
+  CachedInode *entry = &inodeCache[slot];
+  entry->inodeID = inodeID;
+  entry->pins = 0;
+  entry->dirty = 0;
+  entry->ref = 1;
+  entry->mapCount = 0;
+  inodeCacheSlot[inodeID] = slot;
+  return entry;
+}
+
+/*Does the work of inode_get, inodeCacheLock must be held.*/
+static Inode *inodeCache_lookup(int inodeID) {
+  int slot = inodeCacheSlot[inodeID];
+  if (slot >= 0) {
+    inodeCache[slot].ref = 1;
+    return &inodeCache[slot].inode;
+  }
+  CachedInode *entry = inodeCache_insert(inodeID);
+  if (entry == NULL) return NULL;
+  char tblBlock[blockBytes];
+  if (cache_read(inode_block(inodeID), 1, tblBlock) < 0) {//leave the slot empty
+    inodeCacheSlot[inodeID] = -1;
+    entry->inodeID = -1;
+    return NULL;
+  }
+  inode_decode(&entry->inode, inodeID, tblBlock);
+  return &entry->inode;
+}
+
+/*Returns the cached inode with id inodeID, reading it from the inode table if it isn't resident.
+ * The pointer stays valid while the inode is pinned. Returns NULL if it could not be cached.
+ * Its fields belong to the thread holding the inode's lock.*/
+static Inode *inode_get(int inodeID) {
+  pthread_mutex_lock(&inodeCacheLock);
+  Inode *inode = inodeCache_lookup(inodeID);
+  pthread_mutex_unlock(&inodeCacheLock);
+  return inode;
+}
+
+/*Caches a new, empty inode with the given mode. It is written to disk on its next flush.*/
+static Inode *inode_new(int inodeID, int mode) {
+  pthread_mutex_lock(&inodeCacheLock);
+  CachedInode *entry = inodeCache_insert(inodeID);
+  if (entry != NULL) {
+    memset(&entry->inode, 0, sizeof(Inode));
+    entry->inode.mode = mode;
+    entry->dirty = 1;
+    inodeDirtyCount++;
+  }
+  pthread_mutex_unlock(&inodeCacheLock);
+  return entry == NULL ? NULL : &entry->inode;
+}
+
+/*Like inode_get, but keeps the inode resident until inode_unpin is called.*/
+static Inode *inode_pin(int inodeID) {
+  pthread_mutex_lock(&inodeCacheLock);
+  Inode *inode = inodeCache_lookup(inodeID);
+  if (inode != NULL)
+    inodeCache[inodeCacheSlot[inodeID]].pins++;
+  pthread_mutex_unlock(&inodeCacheLock);
+  return inode;
+}
+
+/*Releases a pin taken by inode_pin, writing the inode back if it changed (if that fails, it stays dirty).*/
+static void inode_unpin(int inodeID) {
+  pthread_mutex_lock(&inodeCacheLock);
+  CachedInode *entry = &inodeCache[inodeCacheSlot[inodeID]];
+  if (entry->dirty)
+    inode_writeBack(entry);
+  entry->pins--;
+  pthread_mutex_unlock(&inodeCacheLock);
+}
+
+/*Records that a cached inode differs from its on-disk copy.*/
+static void inode_markDirty(int inodeID) {
+  pthread_mutex_lock(&inodeCacheLock);
+  CachedInode *entry = &inodeCache[inodeCacheSlot[inodeID]];
+  if (!entry->dirty)
+    inodeDirtyCount++;
+  entry->dirty = 1;
+  pthread_mutex_unlock(&inodeCacheLock);
+}
+
+/*Frees an inode: clears its record in the inode table.*/
+static void inode_free(int inodeID) {
+  Inode blank;
+  memset(&blank, 0, sizeof(blank));
+  char tblBlock[blockBytes];
+  pthread_mutex_lock(&inodeCacheLock);//other records of the block may be written at the same time
+  cache_read(inode_block(inodeID), 1, tblBlock);
+  inode_encode(&blank, inodeID, tblBlock);
+  meta_write(inode_block(inodeID), 1, tblBlock);
+  pthread_mutex_unlock(&inodeCacheLock);
+  inodeUsed[inodeID] = 0;
+}
+
+/*Removes an inode from the cache without writing it back (its file is being deleted).*/
+static void inode_drop(int inodeID) {
+  pthread_mutex_lock(&inodeCacheLock);
+  int slot = inodeCacheSlot[inodeID];
+  if (slot >= 0) {
+    if (inodeCache[slot].dirty)
+      inodeDirtyCount--;
+    inodeCache[slot].dirty = 0;
+    inodeCache[slot].inodeID = -1;
+    inodeCacheSlot[inodeID] = -1;
+  }
+  pthread_mutex_unlock(&inodeCacheLock);
+}
+
+/*Writes back the blocks of a table holding changes (dirty[i] set for its block i), one write per run of
+ * consecutive changed blocks, and clears their flags. Returns 0 on success, -1 on failure (the flags of the blocks
+ * that could not be written stay set).*/
+static int table_flush(int firstBlock, int nblocks, const void *table, char *dirty) {
+  int result = 0;
+  int block = 0;
+  while (block < nblocks) {
+    if (!dirty[block]) {
+      block++;
+      continue;
+    }
+    int run = 0;
+    while (block + run < nblocks && dirty[block + run]) {
+      dirty[block + run] = 0;
+      run++;
+    }
+    if (meta_write(firstBlock + block, run, (const char *) table + (long) block * blockBytes) < 0) {
+      memset(dirty + block, 1, run);
+      result = -1;
+    }
+    block += run;
+  }
+  return result;
+}
+
+/*Writes the blocks of the directory holding changed entries back to the root directory file,
+ * one write per run of consecutive changed blocks. Returns 0 on success, -1 on failure.*/
+static int dir_flush() {
+  int result = 0;
+  int block = 0;
+  while (block < dirBlks) {
+    if (!dirBlockDirty[block]) {
+      block++;
+      continue;
+    }
+    int run = 0;
+    while (block + run < dirBlks && dirBlockDirty[block + run]) {
+      dirBlockDirty[block + run] = 0;
+      run++;
+    }
+    int offset = block * blockBytes;
+    int length = min(run * blockBytes, dirBytes - offset);
+    oft[maxFiles - 1].write = offset;//set root directory's write ptr to the first changed block
+    if (file_write(maxFiles - 1, (char *) dir + offset, length) != length) {
+      memset(dirBlockDirty + block, 1, run);
+      result = -1;
+    }
+    block += run;
+  }
+  return result;
+}
+
+/*Writes every pending metadata change (directory, free bitmap and dirty inodes) to the block cache.
+ * Returns 0 on success, -1 if some of it could not be written (it stays pending).*/
+static int metadata_flush() {
+  stat_add(&stats.metadataFlushes, 1);
+  int result = dir_flush();//first, since growing the directory may allocate blocks
+  if (freeMap_flush() < 0)
+    result = -1;
+  if (inodeCache_sync() < 0)
+    result = -1;
+  return result;
+}
+
+/*Writes metadata blocks to the block cache and adds them to the running journal transaction. The transaction is
+ * never committed here, txn_begin made room for every block the step changes (a journal too small for one step can
+ * still fill up, the block is then reported as not written). Returns 0 on success, -1 on failure.*/
+static int meta_write(int blockNum, int nblocks, const void *buf) {
+  int result = cache_write(blockNum, nblocks, buf) < 0 ? -1 : 0;
+  for (int i = 0; i < nblocks; ++i) {
+    if (journal_add(blockNum + i) < 0)
+      result = -1;
+  }
+  return result;
+}
+
+/*Returns how many journal blocks the pending metadata can take once flushed. txnLock must be held exclusively.*/
+static int metadata_pending() {
+  int pending = journal_pending() + inodeDirtyCount;//at most one inode table block per dirty inode
+  for (int block = 0; block < freeMapBlks; ++block)
+    pending += freeMapBlkDirty[block];
+  for (int block = 0; block < dirBlks; ++block)
+    pending += dirBlockDirty[block];
+  return pending + 2;//the root directory's inode and indirect block
+}
+
+/*Flushes and commits all pending metadata. txnLock must be held exclusively. Returns 0 on success, -1 on failure.*/
+static int metadata_commit() {
+  if (metadata_flush() < 0) return -1;//don't commit half of the changes
+  int result = journal_commit();
+  if (result == 0) {//the blocks it freed are free on the disk now
+    pthread_mutex_lock(&allocLock);
+    freeMap_releasePending();
+    pthread_mutex_unlock(&allocLock);
+  }
+  txnReserved = metadata_pending();
+  return result;
+}
 
-static void inodeTbl_flush() {
-  write_blocks(INODE_BLK, INODE_BLKS, inodeTbl);
+/*Commits the pending metadata first if it, plus what one more step can change, might not fit in a single journal
+ * transaction. Starts a new count of the journal blocks calls may take.*/
+static void metadata_reserve() {
+  pthread_rwlock_wrlock(&txnLock);
+  txnReserved = metadata_pending();
+  if (journal_capacity() > 0 && txnReserved + stepJournalBlks > journal_capacity())
+    metadata_commit();
+  pthread_rwlock_unlock(&txnLock);
 }
 
-static void dir_flush() {
-  oft[MAX_FILES - 1].write = 0;//set root directory's write ptr to beginning of file
-  sfs_fwrite(MAX_FILES - 1, (char *) dir, sizeof(dir));
+/*Called at the start of every call that changes the file system, takes txnLock shared until txn_end.
+ * Calls running at the same time each reserve stepJournalBlks on top of the pending metadata, so the exact
+ * (exclusive) count and commit of metadata_reserve only happen once the journal transaction might be full.
+ * A call changing more than that is split into steps with txn_next, and only commits whole steps.*/
+static void txn_begin() {
+  pthread_rwlock_rdlock(&txnLock);
+  pthread_mutex_lock(&reserveLock);
+  int capacity = journal_capacity();
+  int fits = capacity == 0 || txnReserved + stepJournalBlks <= capacity;
+  if (fits)
+    txnReserved += stepJournalBlks;
+  pthread_mutex_unlock(&reserveLock);
+  if (fits) return;
+  pthread_rwlock_unlock(&txnLock);
+  metadata_reserve();
+  pthread_rwlock_rdlock(&txnLock);
+  pthread_mutex_lock(&reserveLock);
+  txnReserved += stepJournalBlks;
+  pthread_mutex_unlock(&reserveLock);
+}
+
+/*Ends a step of a call and starts the next one. The metadata the call changed so far must be consistent on its own:
+ * it may be committed before the next step.*/
+static void txn_next() {
+  pthread_rwlock_unlock(&txnLock);
+  txn_begin();
+}
+
+/*Called at the end of every call that changes the file system. In SFS_FLUSH_SYNC mode, everything the call changed
+ * is committed to the disk before it returns.*/
+static void txn_end() {
+  pthread_rwlock_unlock(&txnLock);
+  flushIfSync();
+}
+
+/*Commits the pending metadata in SFS_FLUSH_SYNC mode.*/
+static void flushIfSync() {
+  if (flushMode != SFS_FLUSH_SYNC) return;
+  metadata_sync();
+}
+
+/*Commits the pending metadata, so that the blocks freed by the running transaction can be allocated again.*/
+static void metadata_sync() {
+  pthread_rwlock_wrlock(&txnLock);
+  metadata_commit();
+  pthread_rwlock_unlock(&txnLock);
+}
+
+/*Selects when metadata reaches the disk: SFS_FLUSH_DEFERRED or SFS_FLUSH_SYNC. Returns 0 on success, -1 on failure.*/
+int sfs_setflushmode(int mode) {
+  if (mode != SFS_FLUSH_DEFERRED && mode != SFS_FLUSH_SYNC) return -1;
+  flushMode = mode;
+  if (mounted) flushIfSync();
+  return 0;
 }
 
 /*Creates a file with the given name and returns it's inode ID, or -1 on failure.*/
@@ -141,33 +705,27 @@ static int createFile(char* name) {
   int freeDirEntry = dir_findFree();
   if (newInodeID < 0) return -1;//no more free inodes
   if (freeDirEntry < 0) return -1;//no more room in directory
-  //allocate a block for the inode
-  int inodeBlock = allocBlk();
-  if (inodeBlock == -1) return -1;//failed to allocate block
+  //set inode metadata, its record is written with the other dirty inodes
+  if (inode_new(newInodeID, MODE_BASIC | MODE_INLINE) == NULL) return -1;//files start out inline
   //reserve the inode
-  inodeTbl[newInodeID] = inodeBlock;
-  inodeTbl_flush();
+  inodeUsed[newInodeID] = 1;
   //reserve directory entry
-  memcpy(dir[freeDirEntry], name, 20);
-  memcpy(&dir[freeDirEntry][20], &newInodeID, sizeof(int));
-  dir_flush();
-  //set inode metadata
-  Inode newInode = {MODE_BASIC};
-  flushInode(newInodeID, newInode);
+  dir_add(freeDirEntry, name, newInodeID);
   return newInodeID;
 }
 
-/*Opens a file with the given name, tries to create a new file if it does not exist. Returns a File Descriptor ID >= 0.
- * returns -1 on failure.*/
-int sfs_fopen(char *name) {
-  //check name length
-  if (strlen(name) > MAX_FNAME_SIZE) return -1;
+/*Does the work of sfs_fopen, dirLock must be held exclusively.*/
+static int file_open(char *name) {
+  //check name length, an empty name would look like an unused directory entry
+  if (strlen(name) > MAX_FNAME_SIZE || name[0] == '\0') return -1;
   int inodeID;
   //search for file name
   int fileDirIndex = dir_find(name);
   //check if file exists
   if (fileDirIndex == -1) {//file doesn't exist
+    txn_begin();
     inodeID = createFile(name);
+    txn_end();
     if (inodeID < 0) return -1;//error creating file
   } else {//file exists
     //get it's inode ID
@@ -177,336 +735,1334 @@ int sfs_fopen(char *name) {
   //find a free slot in the OFT
   int freeOFTSlot = oft_findFree();
   if (freeOFTSlot == -1) return -1;//OFT is full
-  //place data in free slot
-  Inode fileInode = fetchInode(inodeID);
+  //place data in free slot, the inode stays resident until the file is closed
+  Inode *fileInode = inode_pin(inodeID);
+  if (fileInode == NULL) return -1;//every cached inode is pinned
   oft[freeOFTSlot].inodeID = inodeID;
-  oft[freeOFTSlot].write = fileInode.size;
+  oft[freeOFTSlot].write = fileInode->size;
   oft[freeOFTSlot].read = 0;
+  oft[freeOFTSlot].raLast = -1;
+  oft[freeOFTSlot].raWindow = 0;
+  oft[freeOFTSlot].raEnd = 0;
   //return index of slot (FD handle)
   return freeOFTSlot;
 }
 
+/*Opens a file with the given name, tries to create a new file if it does not exist. Returns a File Descriptor ID >= 0.
+ * returns -1 on failure.*/
+int sfs_fopen(char *name) {
+  if (!mounted) return -1;
+  long blocks = stat_callBegin(SFS_CALL_FOPEN);
+  pthread_rwlock_wrlock(&dirLock);
+  int fileID = file_open(name);
+  pthread_rwlock_unlock(&dirLock);
+  stat_callEnd(SFS_CALL_FOPEN, blocks);
+  return fileID;
+}
+
 /*closes an opened file. Returns 0 on success, -1 on failure.*/
 int sfs_fclose(int fileID) {
-  if (fileID < 0 || MAX_FILES <= fileID) return -1;//fileID out of permitted bounds
-  if (oft[fileID].inodeID < 0) return -1;//verify that the file is open.
-  //file is open, close it.
-  oft[fileID].inodeID = -1;// -1 denotes that the file is closed
-  return 0;
+  long blocks = stat_callBegin(SFS_CALL_FCLOSE);
+  if (!mounted || fileID < 0 || maxFiles <= fileID) {//fileID out of permitted bounds
+    stat_callEnd(SFS_CALL_FCLOSE, blocks);
+    return -1;
+  }
+  pthread_rwlock_wrlock(&dirLock);
+  int inodeID = oft[fileID].inodeID;
+  if (inodeID >= 0) {//file is open, close it.
+    txn_begin();
+    inode_unpin(inodeID);
+    oft[fileID].inodeID = -1;// -1 denotes that the file is closed
+    txn_end();
+  }
+  pthread_rwlock_unlock(&dirLock);
+  stat_callEnd(SFS_CALL_FCLOSE, blocks);
+  return inodeID >= 0 ? 0 : -1;
+}
+
+/*Locks the inode of an open file for data I/O and returns its ID, or -1 if fileID is not an open file.*/
+static int file_lock(int fileID) {
+  if (!mounted || fileID < 0 || maxFiles <= fileID) return -1;//fileID out of permitted bounds
+  int inodeID = oft[fileID].inodeID;
+  if (inodeID < 0) return -1;//file is not open
+  pthread_mutex_lock(&inodeLocks[inodeID]);
+  return inodeID;
 }
 
 /*Moves the open file's read pointer to the location loc*/
 int sfs_frseek(int fileID, int loc) {
-  if (fileID < 0 || MAX_FILES <= fileID) return -1;//fileID out of permitted bounds
+  stat_add(&stats.calls[SFS_CALL_SEEK], 1);
+  if (!mounted || fileID < 0 || maxFiles <= fileID) return -1;//fileID out of permitted bounds
   oft[fileID].read = loc;
   return 0;
 }
 
 /*Moves the open file's write pointer to the location loc*/
 int sfs_fwseek(int fileID, int loc) {
-  if (fileID < 0 || MAX_FILES <= fileID) return -1;//fileID out of permitted bounds
+  stat_add(&stats.calls[SFS_CALL_SEEK], 1);
+  if (!mounted || fileID < 0 || maxFiles <= fileID) return -1;//fileID out of permitted bounds
   oft[fileID].write = loc;
   return 0;
 }
 
 /*given the file name path, returns the size of the file. returns -1 if the file doesn't exist.*/
 int sfs_getfilesize(const char* path) {
+  if (!mounted) return -1;
+  long blocks = stat_callBegin(SFS_CALL_GETFILESIZE);
+  int size = -1;
+  pthread_rwlock_rdlock(&dirLock);
   //search directory for file name `path`
   int dirEntryIndex = dir_find(path);
-  if (dirEntryIndex == -1) return -1;//file does not exist
-  int inodeId = inodeID_from_dirIndex(dirEntryIndex);
-  Inode fileInode = fetchInode(inodeId);
-  return fileInode.size;
+  if (dirEntryIndex != -1) {//file exists
+    //the size is read without the inode's lock, so a long write to the file doesn't hold up dirLock
+    Inode *fileInode = inode_get(inodeID_from_dirIndex(dirEntryIndex));
+    if (fileInode != NULL)
+      size = __atomic_load_n(&fileInode->size, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&dirLock);
+  stat_callEnd(SFS_CALL_GETFILESIZE, blocks);
+  return size;
 }
 
-/*Initializes the directory cache by reading the directory contents from the disk.*/
+/*Initializes the directory cache by reading the directory contents from the disk, then builds the name index
+ * and the free entry map from it.*/
 static void dir_init() {
-  oft[MAX_FILES - 1].read = 0;//set root dir's read pointer to beginning of file
-  sfs_fread(MAX_FILES - 1, (char *)dir, sizeof(dir));
+  memset(dir, 0, dirBytes);
+  oft[maxFiles - 1].read = 0;//set root dir's read pointer to beginning of file
+  file_read(maxFiles - 1, (char *)dir, dirBytes);
+  dir_ptr = 0;
+  memset(dirBlockDirty, 0, dirBlks);
+  memset(dirHashHead, -1, sizeof(int) * (dirHashMask + 1));
+  memset(dirFreeMap, 0, sizeof(unsigned int) * ((maxFiles + 31) / 32));
+  dirFreeCount = 0;
+  dirFreeChunk = 0;
+  for (int dirIndex = maxFiles - 1; dirIndex >= 0; --dirIndex) {
+    if (dir[dirIndex][0] == '\0') {// '\0' as the first character denotes an unused entry
+      dirFreeMap[dirIndex / 32] |= 1u << (dirIndex % 32);
+      dirFreeCount++;
+    } else {
+      int bucket = dir_hash(dir[dirIndex]);
+      dirHashNext[dirIndex] = dirHashHead[bucket];
+      dirHashHead[bucket] = dirIndex;
+    }
+  }
 }
 
 /*Initializes the Open File Descriptor Table (OFT) in-memory data structure.
  * After initialization, the OFT will only contain 1 open file, the root directory.*/
 static void oft_init() {
   //open the root dir file at initialization, use the last entry
-  oft[MAX_FILES - 1].inodeID = ROOT_DIR_INODE;
-  oft[MAX_FILES - 1].read = 0;
-  oft[MAX_FILES - 1].write = fetchInode(ROOT_DIR_INODE).size;
+  oft[maxFiles - 1].inodeID = ROOT_DIR_INODE;
+  oft[maxFiles - 1].read = 0;
+  oft[maxFiles - 1].write = inode_pin(ROOT_DIR_INODE)->size;
+  oft[maxFiles - 1].raLast = -1;
+  oft[maxFiles - 1].raWindow = 0;
+  oft[maxFiles - 1].raEnd = 0;
   //all other entries are set to closed
-  for (int i = 0; i < MAX_FILES - 1; ++i) {
+  for (int i = 0; i < maxFiles - 1; ++i) {
     oft[i].inodeID = -1;
     oft[i].read = 0;
     oft[i].write = 0;
   }
 }
 
-/*Initializes the inode table cache by reading the inode table from the disk.*/
+/*Reads the whole inode table, MAX_IO_BLKS blocks per request, and places every inode in use in the inode cache.*/
 static void inodeTbl_init() {
-  memset(inodeTbl, 0, sizeof(inodeTbl));
-  read_blocks(INODE_BLK, 1, inodeTbl);
+  char *tblBuff = malloc((size_t) MAX_IO_BLKS * blockBytes);
+  if (tblBuff == NULL) return;
+  memset(inodeUsed, 0, maxFiles);
+  for (int first = 0; first < inodeTblBlks; first += MAX_IO_BLKS) {
+    int count = min(inodeTblBlks - first, MAX_IO_BLKS);
+    cache_read(INODE_BLK + first, count, tblBuff);
+    for (int inodeID = first * inodesPerBlk; inodeID < min((first + count) * inodesPerBlk, maxFiles); ++inodeID) {
+      char *tblBlock = tblBuff + (long) (inodeID / inodesPerBlk - first) * blockBytes;
+      if (*(int *) (tblBlock + (inodeID % inodesPerBlk) * inodeBytes) == 0) continue;//mode 0 means free
+      inodeUsed[inodeID] = 1;
+      CachedInode *entry = inodeCache_insert(inodeID);
+      if (entry != NULL)
+        inode_decode(&entry->inode, inodeID, tblBlock);
+    }
+  }
+  free(tblBuff);
 }
 
 /*Initializes the Free Bitmap cache by reading the disk's version of it.*/
 void static freeBitmap_init() {
-  read_blocks(FREE_BM_BLK, FREE_BM_BLKS, freeMap);
-}
-
-void mksfs(int fresh) {
-  //disk size: 256KiB (256 blocks)
-  //max file size: 268 KiB (limited by disk size of course)
-  //max number of files: 256
-  //DISK STRUCTURE: [SUPER(1 block)|INODE-TBL(1)|FREE-BITMAP(1)|DATA-BLOCKS(253)]
-  //INODE STRUCTURE: [mode|size|pointer1|...|pointer12|ind-pointer]
-  int blockBuff[BLOCK_BYTES / 4];//temp buffer for writing blocks at FS creation
-  if (fresh) {//insert initial filesystem data
-    init_fresh_disk("sfs", BLOCK_BYTES, BLOCK_COUNT);
-    //init super block
-    blockBuff[0] = BLOCK_BYTES;// size in bytes of a block
-    blockBuff[1] = BLOCK_COUNT;//number of filesystem blocks
-    blockBuff[2] = INODE_BLKS;//number of "inode table" blocks
-    blockBuff[3] = FREE_BM_BLKS;//number of "free bitmap" blocks
-    blockBuff[4] = ROOT_DIR_INODE;// root directory inode index
-    write_blocks(0, 1, blockBuff);//set super block
-    memset(blockBuff, 0, BLOCK_BYTES);//reset blockBuff
-    //set bits in free bitmap
-    //1 super + 1 inode tbl block + 1 free bitmap block + 1 inode (for root dir)
-    //+ 1 (root dir data) = 5 blocks
-    //reserve first 5 blocks
-    blockBuff[0] = -134217728;//(Decimal representation of 0xF8000000, or equivalently, 0b1111100...0)
-    write_blocks(FREE_BM_BLK, 1, blockBuff);//set free bitmap
-    memset(blockBuff, 0, BLOCK_BYTES);//reset blockBuff
-    //init root directory's inode
-    blockBuff[0] = MODE_DIR;
-    blockBuff[2] = 4;//initial data block for root dir
-    write_blocks(3, 1, blockBuff);//set root dir inode
-    memset(blockBuff, 0, BLOCK_BYTES);//reset blockBuff
-    //add root directory’s inode in inode table
-    blockBuff[0] = 3;//point root dir's inode #0 to block #3
-    write_blocks(INODE_BLK, 1, blockBuff);
-    memset(blockBuff, 0, BLOCK_BYTES);//reset blockBuff
-  } else {
-    init_disk("sfs", BLOCK_BYTES, BLOCK_COUNT);
+  cache_read(freeMapBlk, freeMapBlks, freeMap);
+  //bits past the last block are set, so that they are never allocated
+  for (int block = blockCount; block < freeMapChunks * 32; ++block)
+    freeMap[block / 32] |= 0x80000000 >> (block % 32);
+  freeBlkCount = 0;
+  for (int chunk = 0; chunk < freeMapChunks; ++chunk) {
+    freeBlkCount += 32 - __builtin_popcount(freeMap[chunk]);
   }
-  inodeTbl_init();//loads inode table into memory (cache)
+  freeMapCursor = 0;
+  memset(freeMapPending, 0, sizeof(unsigned int) * freeMapChunks);
+  freePendingCount = 0;
+  memset(freeMapBlkDirty, 0, freeMapBlks);
+}
+
+/*Sets the name of the disk image the next mksfs creates or opens.*/
+void sfs_setdisk(const char *imageName) {
+  snprintf(diskImage, sizeof(diskImage), "%s", imageName);
+}
+
+/*Releases the in-memory structures sized by the geometry of the mounted disk.*/
+static void geometry_free() {
+  for (int inodeID = 0; inodeLocks != NULL && inodeID < maxFiles; ++inodeID)
+    pthread_mutex_destroy(&inodeLocks[inodeID]);
+  free(inodeLocks);
+  free(inodeUsed);
+  free(dir);
+  free(dirHashHead);
+  free(dirHashNext);
+  free(dirFreeMap);
+  free(oft);
+  free(freeMap);
+  free(freeMapPending);
+  free(freeMapBlkDirty);
+  free(dirBlockDirty);
+  free(inodeCache);
+  free(inodeCacheSlot);
+  free(zeroBlock);
+  inodeLocks = NULL;
+  inodeUsed = NULL;
+  dir = NULL;
+  dirHashHead = NULL;
+  dirHashNext = NULL;
+  dirFreeMap = NULL;
+  oft = NULL;
+  freeMap = NULL;
+  freeMapPending = NULL;
+  freeMapBlkDirty = NULL;
+  dirBlockDirty = NULL;
+  inodeCache = NULL;
+  inodeCacheSlot = NULL;
+  zeroBlock = NULL;
+  blockBytes = blockCount = maxFiles = 0;
+  inodeTblBlks = inodeBytes = inodesPerBlk = inlineBytes = freeMapBlk = freeMapBlks = freeMapChunks = 0;
+  dirBlks = dirBytes = maxFileSize = 0;
+}
+
+/*Returns the largest file size an inode can address with blocks of newBlockBytes, limited to what the int offsets of
+ * the API can reach.*/
+static long maxFileBytes(int newBlockBytes) {
+  long perBlock = newBlockBytes / (long) sizeof(int);//pointers per indirect block
+  long blocks = 12 + perBlock + perBlock * perBlock + perBlock * perBlock * perBlock;
+  if (blocks > INT_MAX / newBlockBytes) return INT_MAX;
+  return blocks * newBlockBytes;
+}
+
+/*Returns 1 if a disk with the given geometry can hold a file system, 0 otherwise.*/
+static int geometry_valid(int newBlockBytes, int newBlockCount, int newMaxFiles, int newInodeBytes, int tblBlks,
+                          int bmBlks) {
+  if (newBlockBytes < SFS_MIN_BLOCK_BYTES || newBlockBytes > SFS_MAX_BLOCK_BYTES) return 0;
+  if ((newBlockBytes & (newBlockBytes - 1)) != 0) return 0;//not a power of 2
+  if (newInodeBytes < MIN_INODE_BYTES || newInodeBytes > newBlockBytes) return 0;
+  if ((newInodeBytes & (newInodeBytes - 1)) != 0) return 0;//records must not straddle blocks
+  if (newMaxFiles < 2 || newBlockCount < 1 || tblBlks < 1 || bmBlks < 1) return 0;
+  if ((long) tblBlks * newBlockBytes < (long) newMaxFiles * newInodeBytes) return 0;//inode table too small
+  if ((long) bmBlks * newBlockBytes * 8 < newBlockCount) return 0;//bitmap too small
+  if ((long) newMaxFiles * DIR_ENTRY_BYTES > maxFileBytes(newBlockBytes)) return 0;//the directory doesn't fit in a file
+  //super block, tables and the root directory's first data block
+  return INODE_BLK + (long) tblBlks + bmBlks + 1 <= newBlockCount;
+}
+
+/*Takes the geometry of the disk being mounted from its super block and allocates the in-memory structures it sizes.
+ * Returns 0 on success, -1 if the super block is invalid or memory runs out.*/
+static int geometry_set(const int *superBlock) {
+  if (!geometry_valid(superBlock[0], superBlock[1], superBlock[7], superBlock[8], superBlock[2], superBlock[3]))
+    return -1;
+  blockBytes = superBlock[0];
+  blockCount = superBlock[1];
+  inodeTblBlks = superBlock[2];
+  freeMapBlks = superBlock[3];
+  maxFiles = superBlock[7];
+  inodeBytes = superBlock[8];
+  inodesPerBlk = blockBytes / inodeBytes;
+  inlineBytes = inodeBytes - 2 * (int) sizeof(int);
+  freeMapBlk = INODE_BLK + inodeTblBlks;
+  freeMapChunks = (blockCount + 31) / 32;
+  dirBytes = maxFiles * DIR_ENTRY_BYTES;
+  dirBlks = (dirBytes + blockBytes - 1) / blockBytes;
+  maxFileSize = (int) maxFileBytes(blockBytes);
+  //a step maps or frees up to MAX_IO_BLKS blocks: the indirect blocks on its paths, an inode and a directory block,
+  //and the bitmap blocks of the blocks it allocates or frees (including new indirect blocks)
+  stepJournalBlks = STEP_PATH_BLKS + 2 + min(freeMapBlks, MAX_IO_BLKS + STEP_PATH_BLKS);
+  unsigned int buckets = 1;
+  while (buckets < 2 * (unsigned int) maxFiles)
+    buckets <<= 1;
+  dirHashMask = buckets - 1;
+  inodeUsed = malloc(maxFiles);
+  dir = malloc(dirBytes);
+  dirHashHead = malloc(sizeof(int) * buckets);
+  dirHashNext = malloc(sizeof(int) * maxFiles);
+  dirFreeMap = calloc((maxFiles + 31) / 32, sizeof(unsigned int));
+  oft = malloc(sizeof(FD) * maxFiles);
+  freeMap = malloc((size_t) freeMapBlks * blockBytes);
+  freeMapPending = calloc(freeMapChunks, sizeof(unsigned int));
+  freeMapBlkDirty = calloc(freeMapBlks, 1);
+  dirBlockDirty = calloc(dirBlks, 1);
+  inodeCache = malloc(sizeof(CachedInode) * maxFiles);
+  inodeCacheSlot = malloc(sizeof(int) * maxFiles);
+  zeroBlock = calloc(1, blockBytes);
+  if (inodeUsed == NULL || dir == NULL || dirHashHead == NULL || dirHashNext == NULL || dirFreeMap == NULL
+      || oft == NULL || freeMap == NULL || freeMapPending == NULL || freeMapBlkDirty == NULL
+      || dirBlockDirty == NULL || inodeCache == NULL || inodeCacheSlot == NULL || zeroBlock == NULL) {
+    geometry_free();
+    return -1;
+  }
+  inodeLocks = malloc(sizeof(pthread_mutex_t) * maxFiles);
+  if (inodeLocks == NULL) {
+    geometry_free();
+    return -1;
+  }
+  for (int inodeID = 0; inodeID < maxFiles; ++inodeID)
+    pthread_mutex_init(&inodeLocks[inodeID], NULL);
+  return 0;
+}
+
+/*Writes back and releases the mounted disk, if there is one.*/
+static void unmount() {
+  if (!mounted) return;
+  mounted = 0;
+  async_drain();//pending requests use the mounted disk
+  metadata_flush();
+  journal_commit();
+  journal_close();
+  cache_close();
+  close_disk();
+  geometry_free();
+}
+
+/*Mounts diskImage: reads its geometry from the super block, replays the journal and loads the metadata.
+ * Returns 0 on success, -1 on failure.*/
+static int mount() {
+  int superBlock[SFS_MIN_BLOCK_BYTES / sizeof(int)];
+  //the block size isn't known yet, read the start of the super block as a block of the smallest size
+  if (init_disk(diskImage, SFS_MIN_BLOCK_BYTES, 1) < 0) return -1;
+  int result = read_blocks(0, 1, superBlock);
+  close_disk();
+  if (result < 0 || geometry_set(superBlock) < 0) return -1;
+  if (init_disk(diskImage, blockBytes, blockCount) < 0 || cache_init(blockBytes) < 0) {
+    close_disk();
+    geometry_free();
+    return -1;
+  }
+  //replay the last committed transaction before any metadata is read
+  int journalBlk = superBlock[5];
+  int journalBlks = superBlock[6];
+  if (journalBlk < freeMapBlk + freeMapBlks || journalBlks < 0 || journalBlks > blockCount - journalBlk)
+    journalBlks = 0;//images without a journal
+  journal_init(journalBlk, journalBlks, blockBytes);
+  inodeCache_init();//starts with no inode resident
+  inodeTbl_init();//loads every inode in use into the inode cache
   oft_init();//load an open file descriptor table (oft), with only the root directory opened at index 0.
   dir_init();//loads directory into memory (cache)
   freeBitmap_init();//loads the Free Data Block Bitmap into memory (cache)
+  mounted = 1;
+  return 0;
 }
 
-/*Updates the on-disk inode data-structure with in-memory inode.*/
-static void flushInode(int inodeID, Inode inode) {
-  int blk[BLOCK_BYTES / sizeof(int)];
-  int inodeBlkAddr = inodeTbl[inodeID];
-  read_blocks(inodeBlkAddr, 1, (char *) blk);
-  //encode inode to block
-  blk[0] = inode.mode;
-  blk[1] = inode.size;
-  for (int i = 0; i < 13; ++i) {
-    blk[i+2] = inode.pointers[i];
+/*Creates a file system with the given geometry on a fresh disk image and mounts it. blockBytes must be a power of 2
+ * from SFS_MIN_BLOCK_BYTES to SFS_MAX_BLOCK_BYTES, inodeBytes a power of 2 from MIN_INODE_BYTES to blockBytes: larger
+ * records hold larger files inline (up to inodeBytes - 8 bytes) at the cost of a larger inode table.
+ * Returns 0 on success, -1 on failure.*/
+int sfs_format(int newBlockBytes, int newBlockCount, int newMaxFiles, int newInodeBytes) {
+  if (newBlockBytes <= 0 || newMaxFiles < 0 || newBlockCount < 0 || newInodeBytes <= 0) return -1;
+  int tblBlks = (int) (((long) newMaxFiles * newInodeBytes + newBlockBytes - 1) / newBlockBytes);
+  int bmBlks = (int) (((long) newBlockCount + 8L * newBlockBytes - 1) / (8L * newBlockBytes));
+  if (!geometry_valid(newBlockBytes, newBlockCount, newMaxFiles, newInodeBytes, tblBlks, bmBlks)) return -1;
+  int rootDirBlk = INODE_BLK + tblBlks + bmBlks;//first data block, holds the start of the root directory
+  //the journal takes an eighth of the disk, as much as its descriptor block and MAX_JOURNAL_BYTES allow
+  int journalBlks = min(newBlockCount / 8, newBlockBytes / (int) sizeof(int) - 1);
+  journalBlks = min(journalBlks, MAX_JOURNAL_BYTES / newBlockBytes);
+  if (journalBlks < 3 || newBlockCount - journalBlks < rootDirBlk + 1)
+    journalBlks = 0;//no room for a journal
+  int journalBlk = newBlockCount - journalBlks;
+  //DISK STRUCTURE: [SUPER(1 block)|INODE-TBL(tblBlks)|FREE-BITMAP(bmBlks)|DATA-BLOCKS|JOURNAL(journalBlks)]
+  unmount();
+  unsigned int *blockBuff = calloc(tblBlks > bmBlks ? tblBlks : bmBlks, newBlockBytes);//temp buffer for writing blocks at FS creation
+  if (blockBuff == NULL) return -1;
+  if (init_fresh_disk(diskImage, newBlockBytes, newBlockCount) < 0 || cache_init(newBlockBytes) < 0) {
+    free(blockBuff);
+    close_disk();
+    return -1;
+  }
+  //init super block
+  blockBuff[0] = newBlockBytes;// size in bytes of a block
+  blockBuff[1] = newBlockCount;//number of filesystem blocks
+  blockBuff[2] = tblBlks;//number of "inode table" blocks
+  blockBuff[3] = bmBlks;//number of "free bitmap" blocks
+  blockBuff[4] = ROOT_DIR_INODE;// root directory inode index
+  blockBuff[5] = journalBlk;//the journal's block address
+  blockBuff[6] = journalBlks;//number of "journal" blocks
+  blockBuff[7] = newMaxFiles;//number of inode table entries
+  blockBuff[8] = newInodeBytes;//size of an inode record
+  cache_write(0, 1, blockBuff);//set super block
+  memset(blockBuff, 0, (size_t) bmBlks * newBlockBytes);//reset blockBuff
+  //set bits in free bitmap
+  //reserve the super block, the tables and the root dir's first data block,
+  //then the journal and the bits past the last block
+  for (long block = 0; block < (long) bmBlks * newBlockBytes * 8; ++block) {
+    if (block <= rootDirBlk || block >= journalBlk)
+      blockBuff[block / 32] |= 0x80000000 >> (block % 32);
   }
-  write_blocks(inodeBlkAddr, 1, blk);
+  cache_write(rootDirBlk - bmBlks, bmBlks, blockBuff);//set free bitmap
+  memset(blockBuff, 0, (size_t) bmBlks * newBlockBytes);//reset blockBuff
+  //init root directory's inode, the first record of the inode table (every other record is free)
+  blockBuff[0] = MODE_DIR;
+  blockBuff[2] = rootDirBlk;//initial data block for root dir
+  cache_write(INODE_BLK, tblBlks, blockBuff);
+  free(blockBuff);
+  cache_close();
+  close_disk();
+  return mount();
 }
 
-/*Given an index in the inode table (inodeId), this will return the corresponding inode data-structure,*/
-static Inode fetchInode(int inodeId) {
-  Inode inode;
-  int blk[BLOCK_BYTES / 4];
-  read_blocks(inodeTbl[inodeId], 1, blk);
-  //parse inode block
-  inode.mode = blk[0];
-  inode.size = blk[1];
-  for (int i = 0; i < 13; ++i) {
-    inode.pointers[i] = blk[i+2];
+/*Formats diskImage with the default geometry (fresh != 0) or mounts it as it is. Returns 0 on success, -1 if the
+ * disk couldn't be mounted, then every file call fails until a later mksfs or sfs_format succeeds.*/
+int mksfs(int fresh) {
+  if (fresh)//insert initial filesystem data
+    return sfs_format(DEFAULT_BLOCK_BYTES, DEFAULT_BLOCK_COUNT, DEFAULT_MAX_FILES, SFS_DEFAULT_INODE_BYTES);
+  unmount();
+  return mount();
+}
+
+/*Finds where the pointer to file block fileBlock is kept. Returns the number of indirect blocks on its path (0 for a
+ * direct pointer, -1 past the triple indirect block), sets *slot to the inode pointer the path starts from and idx[d]
+ * to the entry used in the indirect block at depth d.*/
+static int pointerPath(int fileBlock, int *slot, int *idx) {
+  long perBlock = blockBytes / (long) sizeof(int);
+  long block = fileBlock;
+  if (block < 12) {
+    *slot = (int) block;
+    return 0;
   }
-  return inode;
+  block -= 12;
+  long span = perBlock;//file blocks reached through the indirect pointer of this depth
+  for (int depth = 1; depth <= 3; ++depth) {
+    if (block < span) {
+      *slot = 11 + depth;
+      for (int d = depth - 1; d >= 0; --d) {
+        idx[d] = (int) (block % perBlock);
+        block /= perBlock;
+      }
+      return depth;
+    }
+    block -= span;
+    span *= perBlock;
+  }
+  return -1;
 }
 
-/*Given a fileID, reads in length bytes from the file to buf*/
-int sfs_fread(int fileID, char *buf, int length) {
-  if (fileID < 0 || MAX_FILES <= fileID) return 0;//fileID out of permitted bounds
+/*Prepares an empty path, buff holds 3 blocks.*/
+static void path_init(IndirectPath *path, int *buff) {
+  for (int d = 0; d < 3; ++d) {
+    path->blockNum[d] = 0;
+    path->dirty[d] = 0;
+    path->entries[d] = buff + d * (blockBytes / (int) sizeof(int));
+  }
+}
+
+/*Loads indirect block blockNum at the given depth of the path, writing back the block it replaces if it changed.
+ * A fresh block starts out as zeros, its old contents aren't read. Returns 0 on success, -1 if a block could not be
+ * written back or read (the depth is then left empty, unless the block is fresh).*/
+static int path_load(IndirectPath *path, int depth, int blockNum, int fresh) {
+  if (path->blockNum[depth] == blockNum) return 0;
+  int result = 0;
+  if (path->dirty[depth] && meta_write(path->blockNum[depth], 1, path->entries[depth]) < 0)
+    result = -1;
+  if (fresh) {
+    memset(path->entries[depth], 0, blockBytes);
+  } else if (cache_read(blockNum, 1, path->entries[depth]) < 0) {
+    path->blockNum[depth] = 0;
+    path->dirty[depth] = 0;
+    return -1;
+  }
+  path->blockNum[depth] = blockNum;
+  path->dirty[depth] = (char) fresh;
+  return result;
+}
+
+/*Writes back the indirect blocks of the path that changed. Returns 0 on success, -1 on failure.*/
+static int path_flush(IndirectPath *path) {
+  int result = 0;
+  for (int d = 0; d < 3; ++d) {
+    if (path->dirty[d] && meta_write(path->blockNum[d], 1, path->entries[d]) < 0)
+      result = -1;
+    path->dirty[d] = 0;
+  }
+  return result;
+}
+
+/*Fills blockNums with the disk addresses of the count file blocks starting at file block `first` by walking the
+ * inode's pointers. Unallocated blocks are reported as addresses <= 0. Consecutive file blocks share the indirect
+ * blocks on their paths, so each of them is read once. Returns 0 on success, -1 if an indirect block can't be read.*/
+static int inode_walk(Inode *inode, int first, int count, int *blockNums) {
+  int pathBuff[3 * (blockBytes / sizeof(int))];
+  IndirectPath path;
+  path_init(&path, pathBuff);
+  for (int i = 0; i < count; ++i) {
+    int slot;
+    int idx[3];
+    int depth = pointerPath(first + i, &slot, idx);
+    if (depth < 0) {//past the largest file
+      blockNums[i] = -1;
+      continue;
+    }
+    int blockNum = inode->pointers[slot];
+    for (int d = 0; d < depth && blockNum > 0; ++d) {
+      if (path_load(&path, d, blockNum, 0) < 0) return -1;
+      blockNum = path.entries[d][idx[d]];
+    }
+    blockNums[i] = blockNum;
+  }
+  return 0;
+}
+
+/*Fills blockNums with the disk addresses of the count (at most MAX_IO_BLKS) file blocks starting at file block
+ * `first`. Unallocated blocks are reported as addresses <= 0. The addresses of a whole window of blocks are kept with
+ * the cached inode, so nearby accesses don't walk the indirect blocks again. Returns 0 on success, -1 on failure.*/
+static int inode_mapBlocks(int inodeID, Inode *inode, int first, int count, int *blockNums) {
+  CachedInode *entry = &inodeCache[inodeCacheSlot[inodeID]];
+  if (first < entry->mapFirst || first + count > entry->mapFirst + entry->mapCount) {
+    entry->mapFirst = first;
+    entry->mapCount = min(MAX_IO_BLKS, maxFileSize / blockBytes - first);
+    if (entry->mapCount < count)
+      entry->mapCount = count;
+    if (inode_walk(inode, first, entry->mapCount, entry->map) < 0) {
+      entry->mapCount = 0;
+      return -1;
+    }
+  }
+  memcpy(blockNums, entry->map + (first - entry->mapFirst), sizeof(int) * count);
+  return 0;
+}
+
+/*Stores dataBlock as the address of file block fileBlock, creating the indirect blocks missing on its path.
+ * An indirect block is allocated on its own, or if the disk is full, taken from the end of the unused part
+ * newBlocks[used + 1, *allocated) of the data block batch. Returns 0 on success, -1 if no block was left or an
+ * indirect block could not be read or written.*/
+static int inode_setPointer(int inodeID, Inode *inode, IndirectPath *path, int fileBlock, int dataBlock,
+                            int *newBlocks, int used, int *allocated) {
+  int slot;
+  int idx[3];
+  int depth = pointerPath(fileBlock, &slot, idx);
+  if (depth < 0) return -1;
+  int *pointer = &inode->pointers[slot];
+  int parent = -1;//depth of the indirect block holding *pointer, -1 for the inode
+  for (int d = 0; d < depth; ++d) {
+    int fresh = *pointer <= 0;
+    if (fresh) {//indirect block missing
+      int indirect = allocBlk();
+      if (indirect < 0) {
+        if (*allocated - 1 <= used) return -1;
+        indirect = newBlocks[--*allocated];
+      }
+      *pointer = indirect;
+      if (parent < 0)
+        inode_markDirty(inodeID);
+      else
+        path->dirty[parent] = 1;
+    }
+    if (path_load(path, d, *pointer, fresh) < 0) return -1;
+    pointer = &path->entries[d][idx[d]];
+    parent = d;
+  }
+  *pointer = dataBlock;
+  if (parent < 0)
+    inode_markDirty(inodeID);
+  else
+    path->dirty[parent] = 1;
+  return 0;
+}
+
+/*Like inode_mapBlocks, but allocates every missing block. fresh[i] is set to 1 if blockNums[i] was just allocated
+ * (its old contents belong to a deleted file, the caller must overwrite or clear it). Returns the number of blocks
+ * mapped, less than count if the disk ran out of space or an indirect block could not be read or written.*/
+static int inode_allocBlocks(int inodeID, Inode *inode, int first, int count, int *blockNums, char *fresh) {
+  if (inode_mapBlocks(inodeID, inode, first, count, blockNums) < 0) return 0;
+  //allocate every missing data block in one batch, the indirect blocks are allocated as their paths are filled in
+  int missing = 0;
+  int goal = -1;//disk address that would continue the file's previous block
+  for (int i = 0; i < count; ++i) {
+    if (blockNums[i] > 0) continue;
+    if (missing == 0) {//first missing block, place the batch after the block preceding it
+      int previous = -1;
+      if (i > 0)
+        previous = blockNums[i - 1];
+      else if (first > 0 && inode_mapBlocks(inodeID, inode, first - 1, 1, &previous) < 0)
+        previous = -1;//only a placement hint
+      goal = previous > 0 ? previous + 1 : -1;
+    }
+    missing++;
+  }
+  if (missing == 0) {
+    memset(fresh, 0, count);
+    return count;
+  }
+  int newBlocks[MAX_IO_BLKS];
+  int allocated = allocBlks(missing, newBlocks, goal);
+  int used = 0;//entries of newBlocks handed out so far
+  int pathBuff[3 * (blockBytes / sizeof(int))];
+  IndirectPath path;
+  path_init(&path, pathBuff);
+  int mapped;
+  for (mapped = 0; mapped < count; ++mapped) {
+    fresh[mapped] = 0;
+    if (blockNums[mapped] > 0) continue;//block already allocated
+    if (used == allocated) break;//disk out of memory
+    if (inode_setPointer(inodeID, inode, &path, first + mapped, newBlocks[used], newBlocks, used, &allocated) < 0)
+      break;//disk out of memory
+    blockNums[mapped] = newBlocks[used++];
+    fresh[mapped] = 1;
+  }
+  CachedInode *entry = &inodeCache[inodeCacheSlot[inodeID]];
+  if (path_flush(&path) < 0) {//the pointers to the new blocks may be lost, report none of them
+    mapped = 0;
+    entry->mapCount = 0;
+  }
+  while (used < allocated)//blocks left over when an indirect block couldn't be allocated
+    freeMap_release(newBlocks[used++]);
+  //keep the mapping cache up to date
+  for (int i = 0; i < mapped; ++i) {
+    int index = first + i - entry->mapFirst;
+    if (index >= 0 && index < entry->mapCount)
+      entry->map[index] = blockNums[i];
+  }
+  return mapped;
+}
+
+/*Returns how many entries, starting at blockNums[i], are consecutive disk blocks (or consecutive holes).*/
+static int blockRun(const int *blockNums, int i, int count) {
+  int run = 1;
+  if (blockNums[i] <= 0) {
+    while (i + run < count && blockNums[i + run] <= 0)
+      run++;
+  } else {
+    while (i + run < count && blockNums[i + run] == blockNums[i] + run)
+      run++;
+  }
+  return run;
+}
+
+/*Readahead for a read of file blocks [firstBlock, lastBlock]. A read that starts in or right after the last block
+ * read by the descriptor is sequential: the window doubles (up to MAX_IO_BLKS, and a quarter of the block cache so
+ * prefetched blocks aren't evicted before they are used) and once less than half a window of blocks is left ahead of
+ * the read, the next blocks up to a window past it are loaded into the block cache. Any other read resets the window.*/
+static void file_readahead(FD *file, Inode *inode, int firstBlock, int lastBlock) {
+  int sequential = file->raLast >= 0 && (firstBlock == file->raLast || firstBlock == file->raLast + 1);
+  file->raLast = lastBlock;
+  if (!sequential) {
+    file->raWindow = 0;
+    file->raEnd = lastBlock + 1;
+    return;
+  }
+  int maxWindow = min(MAX_IO_BLKS, cache_getCapacity() / 4);
+  if (maxWindow < 1) return;
+  file->raWindow = min(file->raWindow > 0 ? 2 * file->raWindow : RA_MIN_BLKS, maxWindow);
+  if (file->raEnd < lastBlock + 1)
+    file->raEnd = lastBlock + 1;
+  if (file->raEnd - (lastBlock + 1) > file->raWindow / 2) return;//enough blocks ahead were already read
+  int fileBlocks = (int) (((long) inode->size + blockBytes - 1) / blockBytes);
+  int count = min(lastBlock + 1 + file->raWindow, fileBlocks) - file->raEnd;
+  if (count <= 0) return;//nothing left ahead of the read
+  int blockNums[MAX_IO_BLKS];
+  if (inode_mapBlocks(file->inodeID, inode, file->raEnd, count, blockNums) < 0) return;//readahead is only a hint
+  for (int i = 0; i < count; ) {
+    int run = blockRun(blockNums, i, count);
+    if (blockNums[i] > 0)
+      cache_prefetch(blockNums[i], run);
+    i += run;
+  }
+  file->raEnd += count;
+}
+
+/*Reads numBytes bytes, starting offset bytes into the run of contiguous disk blocks at blockNum, into dest.
+ * Whole blocks are read straight into dest, only a partial first and last block are staged in blockBuff.
+ * Returns 0 on success, -1 on failure.*/
+static int readRun(int blockNum, int offset, int numBytes, char *dest, char *blockBuff) {
+  if (offset > 0 || numBytes < blockBytes) {//partial first block
+    int head = min(blockBytes - offset, numBytes);
+    if (cache_read(blockNum, 1, blockBuff) < 0) return -1;
+    memcpy(dest, blockBuff + offset, head);
+    dest += head;
+    numBytes -= head;
+    blockNum++;
+  }
+  int fullBlocks = numBytes / blockBytes;
+  if (fullBlocks > 0 && cache_read(blockNum, fullBlocks, dest) < 0) return -1;
+  if (numBytes % blockBytes > 0) {//partial last block
+    if (cache_read(blockNum + fullBlocks, 1, blockBuff) < 0) return -1;
+    memcpy(dest + fullBlocks * blockBytes, blockBuff, numBytes % blockBytes);
+  }
+  return 0;
+}
+
+/*Does the work of sfs_fread, the file's inode lock must be held. Returns the number of bytes read, which falls short
+ * if a block can't be read, or -1 if that happens before any byte was read.*/
+static int file_read(int fileID, char *buf, int length) {
   FD file = oft[fileID];
   if (file.inodeID < 0) return 0;//file is not open
-  Inode inode = fetchInode(file.inodeID);
+  Inode *inode = inode_get(file.inodeID);//pinned while the file is open
   //if read query exceeds file size
-  if (file.read + length > inode.size) {
+  if ((long) file.read + length > inode->size) {
     //then set length to number of bytes from read pointer to file size
-    length = inode.size - file.read;
+    length = inode->size - file.read;
+  }
+  if (length <= 0) return 0;
+  if (inode->mode & MODE_INLINE) {//the data is in the inode table block, a single block read
+    char tblBlock[blockBytes];
+    if (cache_read(inode_block(file.inodeID), 1, tblBlock) < 0) return -1;
+    memcpy(buf, inode_inlineData(file.inodeID, tblBlock) + file.read, length);
+    oft[fileID].read += length;
+    return length;
   }
-  //read into buf from disk block by block.
+  char blockBuff[blockBytes];//staging buffer for partially read blocks
+  int readFirst = file.read / blockBytes;//file blocks covered by this read
+  int readLast = (file.read + length - 1) / blockBytes;
+  //map up to MAX_IO_BLKS blocks at a time, then read each run of contiguous disk blocks with one request
   int bufIndex = 0;
-  while (bufIndex < length) {
-    int blockNum;//address of block being written to
-    char blockBuff[BLOCK_BYTES];//buffer for data block
-    int inodePointer = file.read / BLOCK_BYTES;
-    //get blockNum for inodePointer, it will be <= 0 if it's not allocated
-    if (inodePointer < 12) {//non-indirect pointer
-      blockNum = inode.pointers[inodePointer];
-    } else {//indirect pointer
-      if (inode.pointers[12] <= 0) {//if no block allocated
-        blockNum = -1;
-      } else {
-        //read indirect block into memory
-        read_blocks(inode.pointers[12], 1, blockBuff);
-        int *indirectBlock = (int *) blockBuff;
-        int indirectPointer = inodePointer - 12;
-        blockNum = indirectBlock[indirectPointer];
-      }
+  int failed = 0;
+  while (bufIndex < length && !failed) {
+    int blockNums[MAX_IO_BLKS];
+    int firstBlock = file.read / blockBytes;
+    int blockCount = min((file.read + (length - bufIndex) - 1) / blockBytes - firstBlock + 1, MAX_IO_BLKS);
+    if (inode_mapBlocks(file.inodeID, inode, firstBlock, blockCount, blockNums) < 0) {
+      failed = 1;
+      break;
     }
-    /*now perform read*/
-    //where the read pointer is within the block
-    int blockReadPointer = file.read % BLOCK_BYTES;
-    //read until either end of block or end of buffer
-    int numBytes = min(BLOCK_BYTES - blockReadPointer, length - bufIndex);
-    if (blockNum <= 0) {
-      //no data block, treat as all-zero block
-      memset(&buf[bufIndex], 0, numBytes);
-    } else {
-      //there is a data block, read it into memory and transfer to buf
-      read_blocks(blockNum, 1, blockBuff);
-      memcpy(&buf[bufIndex], blockBuff+blockReadPointer, numBytes);
+    for (int i = 0; i < blockCount; ) {
+      int run = blockRun(blockNums, i, blockCount);
+      //where the read pointer is within the first block of the run
+      int blockReadPointer = file.read % blockBytes;
+      //read until either end of run or end of buffer
+      int numBytes = min(run * blockBytes - blockReadPointer, length - bufIndex);
+      if (blockNums[i] <= 0) {
+        //no data blocks, treat as all-zero blocks
+        memset(&buf[bufIndex], 0, numBytes);
+      } else if (readRun(blockNums[i], blockReadPointer, numBytes, &buf[bufIndex], blockBuff) < 0) {
+        failed = 1;//stop at the run that couldn't be read
+        break;
+      }
+      file.read += numBytes;
+      bufIndex += numBytes;
+      i += run;
     }
-    file.read += numBytes;
-    bufIndex += numBytes;
   }
+  if (!failed)
+    file_readahead(&file, inode, readFirst, readLast);
   //update open file descriptor table
-  oft[fileID] = file;
-  return bufIndex;
+  oft[fileID].read = file.read;
+  oft[fileID].raLast = file.raLast;
+  oft[fileID].raWindow = file.raWindow;
+  oft[fileID].raEnd = file.raEnd;
+  return failed && bufIndex == 0 ? -1 : bufIndex;
+}
+
+/*Given a fileID, reads in length bytes from the file to buf. Returns the number of bytes read, -1 if the disk failed
+ * before any was read*/
+int sfs_fread(int fileID, char *buf, int length) {
+  long blocks = stat_callBegin(SFS_CALL_FREAD);
+  int inodeID = file_lock(fileID);
+  if (inodeID < 0) {
+    stat_callEnd(SFS_CALL_FREAD, blocks);
+    return 0;
+  }
+  int read = file_read(fileID, buf, length);
+  pthread_mutex_unlock(&inodeLocks[inodeID]);
+  if (read > 0)
+    stat_add(&stats.bytesRead, read);
+  stat_callEnd(SFS_CALL_FREAD, blocks);
+  return read;
 }
 
-/*Given a fileID, writes length bytes from buf to the file*/
+/*Reserves the blocks backing bytes [offset, offset + length) of an open file, so that later writes to that range
+ * can't run out of space and (in SFS_ALLOC_EXTENT mode) land in contiguous blocks. The file size is not changed.
+ * Returns 0 on success, -1 on failure (blocks reserved before the disk ran out of space are kept).*/
+int sfs_fallocate(int fileID, int offset, int length) {
+  long blocks = stat_callBegin(SFS_CALL_FALLOCATE);
+  int inodeID = file_lock(fileID);
+  if (inodeID < 0) {
+    stat_callEnd(SFS_CALL_FALLOCATE, blocks);
+    return -1;
+  }
+  txn_begin();
+  int result = file_allocate(fileID, offset, length);
+  txn_end();
+  if (result < 0 && freeMap_hasPending()) {//out of space, but blocks are waiting for the transaction to commit
+    metadata_sync();
+    txn_begin();
+    result = file_allocate(fileID, offset, length);
+    txn_end();
+  }
+  pthread_mutex_unlock(&inodeLocks[inodeID]);
+  stat_callEnd(SFS_CALL_FALLOCATE, blocks);
+  return result;
+}
+
+/*Does the work of sfs_fallocate, each window of MAX_IO_BLKS blocks in its own step (see txn_next). The file's inode
+ * lock and txnLock must be held.*/
+static int file_allocate(int fileID, int offset, int length) {
+  FD file = oft[fileID];
+  if (offset < 0 || length < 0 || (long) offset + length > maxFileSize) return -1;
+  if (length == 0) return 0;
+  Inode *inode = inode_get(file.inodeID);//pinned while the file is open
+  if (inode->mode & MODE_INLINE) {
+    if ((long) offset + length <= inlineBytes) return 0;//the inode record already holds the range
+    if (inode_promote(file.inodeID, inode) < 0) return -1;
+  }
+  int result = 0;
+  int block = offset / blockBytes;
+  int endBlock = (offset + length - 1) / blockBytes;
+  while (block <= endBlock) {
+    int blockNums[MAX_IO_BLKS];
+    char fresh[MAX_IO_BLKS];
+    int blockCount = min(endBlock - block + 1, MAX_IO_BLKS);
+    if (block > offset / blockBytes)
+      txn_next();
+    int mapped = inode_allocBlocks(file.inodeID, inode, block, blockCount, blockNums, fresh);
+    //a block keeps the data of its previous file when freed, the new ones are cleared before the file points at them
+    for (int i = 0; i < mapped; ++i) {
+      if (fresh[i] && cache_write(blockNums[i], 1, zeroBlock) < 0)
+        result = -1;
+    }
+    block += mapped;
+    if (mapped < blockCount || result < 0) {//disk out of memory, or failing
+      result = -1;
+      break;
+    }
+  }
+  return result;
+}
+
+/*Loads the current contents of a block that is about to be partly overwritten. Fresh blocks start out as zeros.
+ * Returns 0 on success, -1 on failure.*/
+static int loadPartialBlock(char *dest, int blockNum, char fresh) {
+  if (fresh) {
+    memset(dest, 0, blockBytes);
+    return 0;
+  }
+  return cache_read(blockNum, 1, dest) < 0 ? -1 : 0;
+}
+
+/*Writes whole blocks of a file to the block cache. The directory's blocks are metadata, they go through the journal.
+ * Returns 0 on success, -1 on failure.*/
+static int file_writeBlocks(int inodeID, int blockNum, int nblocks, const void *buf) {
+  if (inodeID == ROOT_DIR_INODE)
+    return meta_write(blockNum, nblocks, buf);
+  return cache_write(blockNum, nblocks, buf) < 0 ? -1 : 0;
+}
+
+/*Writes numBytes bytes from src, starting offset bytes into the run of contiguous disk blocks at blockNum (fresh is
+ * set for the blocks that were just allocated). Whole blocks are written straight from src, only a partial first and
+ * last block are merged with their current contents in blockBuff. Returns 0 on success, -1 on failure (part of the
+ * run may have been written).*/
+static int writeRun(int inodeID, int blockNum, const char *fresh, int offset, int numBytes, const char *src,
+                    char *blockBuff) {
+  if (offset > 0 || numBytes < blockBytes) {//partial first block
+    int head = min(blockBytes - offset, numBytes);
+    if (loadPartialBlock(blockBuff, blockNum, fresh[0]) < 0) return -1;
+    memcpy(blockBuff + offset, src, head);
+    if (file_writeBlocks(inodeID, blockNum, 1, blockBuff) < 0) return -1;
+    src += head;
+    numBytes -= head;
+    blockNum++;
+    fresh++;
+  }
+  int fullBlocks = numBytes / blockBytes;
+  if (fullBlocks > 0 && file_writeBlocks(inodeID, blockNum, fullBlocks, src) < 0) return -1;
+  if (numBytes % blockBytes > 0) {//partial last block
+    if (loadPartialBlock(blockBuff, blockNum + fullBlocks, fresh[fullBlocks]) < 0) return -1;
+    memcpy(blockBuff, src + fullBlocks * blockBytes, numBytes % blockBytes);
+    return file_writeBlocks(inodeID, blockNum + fullBlocks, 1, blockBuff);
+  }
+  return 0;
+}
+
+/*Given a fileID, writes length bytes from buf to the file. Returns the number of bytes written, which falls short if
+ * the disk is full, or -1 if the disk failed before any was written*/
 int sfs_fwrite(int fileID, char *buf, int length) {
-  if (fileID < 0 || MAX_FILES <= fileID) return 0;//fileID out of permitted bounds
+  long blocks = stat_callBegin(SFS_CALL_FWRITE);
+  int inodeID = file_lock(fileID);
+  if (inodeID < 0) {
+    stat_callEnd(SFS_CALL_FWRITE, blocks);
+    return 0;
+  }
+  txn_begin();
+  int written = file_writeSteps(fileID, buf, length);
+  txn_end();
+  if (written >= 0 && written < length && freeMap_hasPending()) {//out of space, but blocks are waiting to be freed
+    metadata_sync();
+    txn_begin();
+    int more = file_writeSteps(fileID, buf + written, length - written);
+    txn_end();
+    if (more > 0)
+      written += more;
+  }
+  pthread_mutex_unlock(&inodeLocks[inodeID]);
+  if (written > 0)
+    stat_add(&stats.bytesWritten, written);
+  stat_callEnd(SFS_CALL_FWRITE, blocks);
+  return written;
+}
+
+/*Does the work of sfs_fwrite with one file_write per window of MAX_IO_BLKS blocks, each in its own step (see
+ * txn_next): file_write leaves the file's size and pointers consistent with the data it wrote. The file's inode lock
+ * and txnLock must be held. Returns what file_write does for the whole range.*/
+static int file_writeSteps(int fileID, const char *buf, int length) {
+  int written = 0;
+  while (written < length) {
+    int step = min(length - written, MAX_IO_BLKS * blockBytes - oft[fileID].write % blockBytes);
+    if (written > 0)
+      txn_next();
+    int result = file_write(fileID, buf + written, step);
+    if (result < 0) return written > 0 ? written : -1;
+    written += result;
+    if (result < step) break;//disk full or failing
+  }
+  return written;
+}
+
+/*Writes length bytes at the write pointer of an inline file, which must fit in its inode record.
+ * Returns 0 on success, -1 on failure.*/
+static int file_writeInline(int fileID, const char *buf, int length) {
+  FD file = oft[fileID];
+  Inode *inode = inode_get(file.inodeID);
+  char tblBlock[blockBytes];
+  pthread_mutex_lock(&inodeCacheLock);//other records of the block may be written at the same time
+  int result = cache_read(inode_block(file.inodeID), 1, tblBlock) < 0 ? -1 : 0;
+  if (result == 0) {
+    memcpy(inode_inlineData(file.inodeID, tblBlock) + file.write, buf, length);
+    result = meta_write(inode_block(file.inodeID), 1, tblBlock);
+  }
+  pthread_mutex_unlock(&inodeCacheLock);
+  if (result < 0) return -1;
+  oft[fileID].write += length;
+  if (oft[fileID].write > inode->size) {
+    __atomic_store_n(&inode->size, oft[fileID].write, __ATOMIC_RELAXED);//read by sfs_getfilesize without the inode lock
+    inode_markDirty(file.inodeID);
+  }
+  return 0;
+}
+
+/*Moves the data of an inline file that is about to outgrow its inode record into its first data block, so it is
+ * addressed through block pointers from now on. Returns 0 on success, -1 if no block could be allocated or written
+ * (the file then stays inline).*/
+static int inode_promote(int inodeID, Inode *inode) {
+  char tblBlock[blockBytes];
+  if (cache_read(inode_block(inodeID), 1, tblBlock) < 0) return -1;
+  inode->mode &= ~MODE_INLINE;
+  inode_markDirty(inodeID);
+  if (inode->size == 0) return 0;
+  int blockNum;
+  char fresh;
+  if (inode_allocBlocks(inodeID, inode, 0, 1, &blockNum, &fresh) < 1) {//disk out of memory, stay inline
+    inode->mode |= MODE_INLINE;
+    return -1;
+  }
+  char dataBlock[blockBytes];
+  memset(dataBlock, 0, blockBytes);
+  memcpy(dataBlock, inode_inlineData(inodeID, tblBlock), inode->size);
+  if (cache_write(blockNum, 1, dataBlock) < 0) {//the data is still in the inode record, give the block back
+    inode->mode |= MODE_INLINE;
+    inode->pointers[0] = 0;
+    inodeCache[inodeCacheSlot[inodeID]].mapCount = 0;
+    freeMap_release(blockNum);
+    return -1;
+  }
+  return 0;
+}
+
+/*Does the work of sfs_fwrite, metadata changes are left pending. The file's inode lock and txnLock must be held
+ * (only txnLock for the root directory, which is written by metadata_flush). Returns the number of bytes written,
+ * which falls short if the disk is full or a block can't be written, or -1 if a block can't be written before any
+ * byte was.*/
+static int file_write(int fileID, const char *buf, int length) {
+  if (fileID < 0 || maxFiles <= fileID) return 0;//fileID out of permitted bounds
   FD file = oft[fileID];
-  Inode inode = fetchInode(file.inodeID);
+  if (file.inodeID < 0) return 0;//file is not open
+  Inode *inode = inode_get(file.inodeID);//pinned while the file is open
   //if write query exceeds maximum file size
-  if (file.write + length > MAX_FILE_SIZE)
+  if ((long) file.write + length > maxFileSize)
     //set length = remaining file space
-    length = MAX_FILE_SIZE - file.write;
-  //write buf to disk block by block.
+    length = maxFileSize - file.write;
+  if (length <= 0) return 0;
+  if (inode->mode & MODE_INLINE) {
+    if ((long) file.write + length <= inlineBytes)//still fits in the inode record
+      return file_writeInline(fileID, buf, length) < 0 ? -1 : length;
+    if (inode_promote(file.inodeID, inode) < 0) return 0;
+  }
+  char blockBuff[blockBytes];//staging buffer for partially written blocks
+  //map (allocating as needed) up to MAX_IO_BLKS blocks at a time, then write each contiguous run with one request
   int bufIndex = 0;
-  while (bufIndex < length) {
-    int blockNum;//address of block being written to
-    char blockBuff[BLOCK_BYTES];//buffer for Data Block
-    int inodePointer = file.write / BLOCK_BYTES;
-    //get blockNum for inodePointer, allocate blocks as needed
-    if (inodePointer < 12) {//none-indirect pointer
-      if (inode.pointers[inodePointer] <= 0)//no block already allocated
-        if((inode.pointers[inodePointer] = allocBlk()) < 0)//allocate 1 block
-          return bufIndex;//disk out of memory
-      blockNum = inode.pointers[inodePointer];
-    } else {//indirect pointer
-      if (inode.pointers[12] <= 0)//no block already allocated
-        if((inode.pointers[12] = allocBlk()) < 0)//allocate 1 block
-          return bufIndex;//disk out of memory
-      //read indirect block into memory
-      read_blocks(inode.pointers[12], 1, blockBuff);
-      //check if block needs to be allocated
-      int *indirectBlock = (int *) blockBuff;
-      int indirectPointer = inodePointer - 12;
-      if (indirectBlock[indirectPointer] <= 0) {//no block already allocated
-        if ((indirectBlock[indirectPointer] = allocBlk()) < 0)
-          return bufIndex;//disk out of memory
-        write_blocks(inode.pointers[12], 1, blockBuff);//flush change to disk
+  int failed = 0;
+  while (bufIndex < length && !failed) {
+    int blockNums[MAX_IO_BLKS];
+    char fresh[MAX_IO_BLKS];
+    int firstBlock = file.write / blockBytes;
+    int blockCount = min((file.write + (length - bufIndex) - 1) / blockBytes - firstBlock + 1, MAX_IO_BLKS);
+    int mapped = inode_allocBlocks(file.inodeID, inode, firstBlock, blockCount, blockNums, fresh);
+    for (int i = 0; i < mapped; ) {
+      int run = blockRun(blockNums, i, mapped);
+      //where the write pointer is within the first block of the run
+      int blockWritePointer = file.write % blockBytes;
+      //number of bytes to write, write until either end of run or end of buffer
+      int numBytes = min(run * blockBytes - blockWritePointer, length - bufIndex);
+      int lastBlock = (blockWritePointer + numBytes - 1) / blockBytes;//index in the run of the last block written
+      if (writeRun(file.inodeID, blockNums[i], &fresh[i], blockWritePointer, numBytes, &buf[bufIndex], blockBuff) < 0) {
+        failed = 1;//stop at the run that couldn't be written
+        break;
       }
-      blockNum = indirectBlock[indirectPointer];
+      file.write += numBytes;
+      bufIndex += numBytes;
+      i += lastBlock + 1;
     }
-    /*now perform write*/
-
-    //where the write pointer is within the block
-    int blockWritePointer = file.write % BLOCK_BYTES;
-    //number of bytes to write, write until either end of block or end of buffer
-    int numBytes = min(BLOCK_BYTES - blockWritePointer, length - bufIndex);
-    //only read existing block if we don't overwrite the entire block
-    if (numBytes < BLOCK_BYTES)
-      read_blocks(blockNum, 1, blockBuff);
-    memcpy(&blockBuff[blockWritePointer], &buf[bufIndex], numBytes);
-    write_blocks(blockNum, 1, blockBuff);
-    file.write += numBytes;
-    bufIndex += numBytes;
+    if (mapped < blockCount) break;//disk out of memory
   }
   //if data was appended, update file size
-  if (file.write > inode.size)
-    inode.size = file.write;
+  if (file.write > inode->size) {
+    __atomic_store_n(&inode->size, file.write, __ATOMIC_RELAXED);//read by sfs_getfilesize without the inode lock
+    inode_markDirty(file.inodeID);
+  }
   //update open file descriptor table cache
-  oft[fileID] = file;
-  //update inode table cache
-  flushInode(file.inodeID, inode);//updates the inode's Data Block
-  return bufIndex;
+  oft[fileID].write = file.write;
+  return failed && bufIndex == 0 ? -1 : bufIndex;
 }
 
-static void freeMap_flush() {
-  write_blocks(FREE_BM_BLK, 1, (char *) freeMap);
+/*Commits all pending metadata, writes every cached block back to the disk and forces it to stable storage.
+ * Returns 0 on success, -1 on failure.*/
+int sfs_sync() {
+  if (!mounted) return -1;
+  long blocks = stat_callBegin(SFS_CALL_SYNC);
+  pthread_rwlock_wrlock(&txnLock);
+  int result = metadata_commit();
+  pthread_rwlock_unlock(&txnLock);
+  stat_callEnd(SFS_CALL_SYNC, blocks);
+  if (result < 0) return -1;
+  return sync_disk();
 }
 
-/*allocates a data block and writes its address to buf. Returns the block number on success, -1 on failure.*/
-static int allocBlk() {
-  int addr = 0;
-  //iterate over each int buffer in the freeMap cache
-  for (unsigned long i = 0; i < (sizeof(freeMap) / sizeof(int)); ++i) {
-    //check if one of the bits is 0
-    if ((~freeMap[i]) > 0) {//one of the bits is 0
-      unsigned int mask = 0x80000000;//0b10000000...0
-      for (unsigned long j = 0; j < 8 * sizeof(int); ++j) {
-        if (~freeMap[i] & mask) {//block at address 'addr' is free
-          freeMap[i] |= mask;//reserve block in free bitmap by marking the bit
-          freeMap_flush();
-          return addr;
-        } else {//block at address 'addr' not free, try next block
-          mask >>= (unsigned int) 1;
-          addr++;
-        }
-      }
-    } else {//all bits are 1, try next chunk of bits
-      addr += 8 * sizeof(int);
+/*Writes back the cached blocks of a file: its inode block, top-level indirect blocks and data blocks.
+ * (Lower indirect blocks are metadata, they are written back by the journal.)*/
+static int file_syncBlocks(int inodeID) {
+  Inode *inode = inode_get(inodeID);
+  if (inode == NULL) return -1;
+  int result = cache_syncRange(inode_block(inodeID), 1);//also holds an inline file's data
+  if (inode->mode & MODE_INLINE) return result;
+  for (int slot = 12; slot < INODE_POINTERS; ++slot) {
+    if (inode->pointers[slot] > 0 && cache_syncRange(inode->pointers[slot], 1) < 0)
+      result = -1;
+  }
+  int blockCount = (inode->size + blockBytes - 1) / blockBytes;
+  for (int first = 0; first < blockCount; first += MAX_IO_BLKS) {
+    int blockNums[MAX_IO_BLKS];
+    int count = min(blockCount - first, MAX_IO_BLKS);
+    inode_mapBlocks(inodeID, inode, first, count, blockNums);
+    for (int i = 0; i < count; ) {
+      int run = blockRun(blockNums, i, count);
+      if (blockNums[i] > 0 && cache_syncRange(blockNums[i], run) < 0)
+        result = -1;
+      i += run;
+    }
+  }
+  return result;
+}
+
+/*Writes an open file's data and metadata to the disk, along with the shared structures (free bitmap, inode table
+ * and directory) that refer to it. If metadata changed, this commits the running journal transaction, which writes
+ * back the data of every file. Otherwise blocks of other files stay cached. Returns 0 on success, -1 on failure.*/
+int sfs_fsync(int fileID) {
+  long blocks = stat_callBegin(SFS_CALL_SYNC);
+  int inodeID = file_lock(fileID);
+  if (inodeID < 0) {
+    stat_callEnd(SFS_CALL_SYNC, blocks);
+    return -1;
+  }
+  pthread_rwlock_wrlock(&txnLock);
+  int result = file_sync(fileID);
+  pthread_rwlock_unlock(&txnLock);
+  pthread_mutex_unlock(&inodeLocks[inodeID]);
+  stat_callEnd(SFS_CALL_SYNC, blocks);
+  return result;
+}
+
+/*Does the work of sfs_fsync, the file's inode lock and txnLock (exclusively) must be held.*/
+static int file_sync(int fileID) {
+  if (metadata_flush() < 0) return -1;
+  if (journal_pending() > 0) {
+    if (metadata_commit() < 0) return -1;
+    return sync_disk();
+  }
+  int result = 0;
+  if (cache_syncRange(0, freeMapBlk + freeMapBlks) < 0)//super block, inode table and free bitmap
+    result = -1;
+  if (file_syncBlocks(ROOT_DIR_INODE) < 0)
+    result = -1;
+  if (file_syncBlocks(oft[fileID].inodeID) < 0)
+    result = -1;
+  if (sync_disk() < 0)
+    result = -1;
+  return result;
+}
+
+/*Writes the blocks of the in-memory free bitmap that changed since the last flush, with the blocks freed by the
+ * running transaction marked free. In memory they stay allocated until it commits. Returns 0 on success, -1 on
+ * failure.*/
+static int freeMap_flush() {
+  pthread_mutex_lock(&allocLock);
+  freeMap_flipPending();//clear the bits of the pending blocks while the bitmap is written
+  int result = table_flush(freeMapBlk, freeMapBlks, freeMap, freeMapBlkDirty);
+  freeMap_flipPending();
+  pthread_mutex_unlock(&allocLock);
+  return result;
+}
+
+/*Records that the bit of blockNum changed, so that freeMap_flush rewrites the bitmap block holding it.*/
+static void freeMap_markDirty(int blockNum) {
+  freeMapBlkDirty[blockNum / (blockBytes * 8)] = 1;
+}
+
+/*Returns 1 if blockNum is marked free in the bitmap.*/
+static int blk_isFree(int blockNum) {
+  return (freeMap[blockNum / 32] & (0x80000000 >> (blockNum % 32))) == 0;
+}
+
+/*Returns the number of consecutive free blocks starting at start, counting at most max.*/
+static int freeRunLength(int start, int max) {
+  int length = 0;
+  while (length < max && start + length < blockCount && blk_isFree(start + length))
+    length++;
+  return length;
+}
+
+/*Returns the first block of a run of at least length free blocks, searching from the next-fit cursor and skipping
+ * full chunks. Returns -1 if no such run exists.*/
+static int findFreeRun(int length) {
+  for (int checked = 0; checked < freeMapChunks; ++checked) {
+    int chunk = (freeMapCursor + checked) % freeMapChunks;
+    stat_add(&stats.allocScans, 1);
+    unsigned int bits = freeMap[chunk];
+    while (bits != 0xFFFFFFFF) {
+      int bit = __builtin_clz(~bits);//first free block left in this chunk
+      int run = freeRunLength(chunk * 32 + bit, length);
+      if (run == length)
+        return chunk * 32 + bit;
+      //mark the run that was too short as seen
+      unsigned int fromBit = 0xFFFFFFFF >> bit;
+      unsigned int pastRun = bit + run >= 32 ? 0 : 0xFFFFFFFF >> (bit + run);
+      bits |= fromBit & ~pastRun;
     }
   }
   return -1;
 }
 
+/*Marks the length free blocks starting at start as used and appends their addresses to blockNums.*/
+static void takeRun(int start, int length, int *blockNums) {
+  for (int i = 0; i < length; ++i) {
+    freeMap[(start + i) / 32] |= 0x80000000 >> ((start + i) % 32);
+    freeMap_markDirty(start + i);
+    blockNums[i] = start + i;
+  }
+  freeBlkCount -= length;
+}
+
+/*Allocates up to count data blocks and writes their addresses to blockNums. In SFS_ALLOC_EXTENT mode the blocks are
+ * taken from the free run starting at goal (the block after the file's previous one, -1 if there is none), then
+ * from a single free run large enough for the rest. Otherwise, or if no such run exists, the search scans a whole
+ * chunk of the bitmap at a time, starting from where the previous allocation stopped (next-fit).
+ * Only the in-memory bitmap is updated, it is written back with the other metadata by metadata_flush.
+ * Returns the number of blocks allocated, less than count if the disk is full.*/
+static int allocBlks(int count, int *blockNums, int goal) {
+  int allocated = 0;
+  pthread_mutex_lock(&allocLock);
+  if (allocMode == SFS_ALLOC_EXTENT && count > 0) {
+    if (goal > 0 && goal < blockCount) {//extend the file's current extent
+      int run = freeRunLength(goal, count);
+      takeRun(goal, run, blockNums);
+      allocated += run;
+    }
+    int start;
+    if (allocated < count && (start = findFreeRun(count - allocated)) >= 0) {//start a new extent
+      takeRun(start, count - allocated, blockNums + allocated);
+      allocated = count;
+    }
+  }
+  for (int checked = 0; checked < freeMapChunks && allocated < count && freeBlkCount > 0; ++checked) {
+    unsigned int *chunk = &freeMap[freeMapCursor];
+    stat_add(&stats.allocScans, 1);
+    //bit 31 of a chunk is its first block, so the first free block is the number of leading 1s
+    while (*chunk != 0xFFFFFFFF && allocated < count) {
+      int bit = __builtin_clz(~*chunk);
+      *chunk |= 0x80000000 >> bit;//reserve block in free bitmap by marking the bit
+      blockNums[allocated] = freeMapCursor * 32 + bit;
+      freeMap_markDirty(blockNums[allocated++]);
+      freeBlkCount--;
+    }
+    if (allocated < count)//chunk is full, try next chunk of bits
+      freeMapCursor = (freeMapCursor + 1) % freeMapChunks;
+  }
+  pthread_mutex_unlock(&allocLock);
+  return allocated;
+}
+
+/*Selects how blocks are placed: SFS_ALLOC_EXTENT or SFS_ALLOC_NEXTFIT. Returns 0 on success, -1 on failure.*/
+int sfs_setallocmode(int mode) {
+  if (mode != SFS_ALLOC_EXTENT && mode != SFS_ALLOC_NEXTFIT) return -1;
+  allocMode = mode;
+  return 0;
+}
+
+/*allocates a data block. Returns the block number on success, -1 on failure.*/
+static int allocBlk() {
+  int blockNum;
+  if (allocBlks(1, &blockNum, 0) < 1) return -1;
+  return blockNum;
+}
+
+/*Releases a block of a file. Its data is left as it is (blocks are cleared when they are allocated, see
+ * inode_allocBlocks), and it can't be allocated again before the running transaction commits.*/
 static void freeBlk(int blockNum) {
-  //used to clear data in the block being freed
-  static char blank[BLOCK_BYTES];//static declaration ensures all entries are initialized to 0
-  //clear the block's data
-  write_blocks(blockNum, 1, blank);
+  pthread_mutex_lock(&allocLock);
+  freeMapPending[blockNum / 32] |= 0x80000000 >> (blockNum % 32);
+  freePendingCount++;
+  freeMap_markDirty(blockNum);//counted with the pending metadata, freeMap_flush writes the bit cleared
+  pthread_mutex_unlock(&allocLock);
+}
+
+/*Flips the bits of the blocks freed by the running transaction in the in-memory bitmap (they are set while the
+ * blocks are pending). allocLock must be held.*/
+static void freeMap_flipPending() {
+  for (int chunk = 0; chunk < freeMapChunks && freePendingCount > 0; ++chunk)
+    freeMap[chunk] ^= freeMapPending[chunk];
+}
+
+/*Clears the bits of the blocks freed by a transaction that just committed in the in-memory bitmap, so they can be
+ * allocated again. allocLock must be held, and txnLock exclusively: nothing was freed since the bitmap was flushed.*/
+static void freeMap_releasePending() {
+  for (int chunk = 0; chunk < freeMapChunks && freePendingCount > 0; ++chunk) {
+    if (freeMapPending[chunk] == 0) continue;
+    freeMap[chunk] &= ~freeMapPending[chunk];
+    freeBlkCount += __builtin_popcount(freeMapPending[chunk]);
+    freePendingCount -= __builtin_popcount(freeMapPending[chunk]);
+    freeMapPending[chunk] = 0;
+  }
+}
+
+/*Returns 1 if blocks freed by the running transaction are waiting for it to commit.*/
+static int freeMap_hasPending() {
+  pthread_mutex_lock(&allocLock);
+  int result = freePendingCount > 0;
+  pthread_mutex_unlock(&allocLock);
+  return result;
+}
+
+/*Marks a block as free in the in-memory bitmap right away. Only for blocks no metadata on disk points at, such as
+ * blocks allocated by the running call that it didn't use.*/
+static void freeMap_release(int blockNum) {
   //get the index (chunk) in the freeMap cache
   int chunk = blockNum / (sizeof(int) * 8);
   //get the bit in the chunk that represents to block
   unsigned int chunkOffset = blockNum % (sizeof(int) * 8);
   //bit-mask used to flip bit representing blockNum to 0
   unsigned int mask = ~((unsigned int)0x80000000>>chunkOffset);//111..0..111
+  pthread_mutex_lock(&allocLock);
   freeMap[chunk] &= mask;//flip the bit from 1 to 0
-  freeMap_flush();
+  freeBlkCount++;
+  freeMap_markDirty(blockNum);
+  pthread_mutex_unlock(&allocLock);
 }
 
+/*Frees the blocks under an indirect block, last first, and then the indirect block itself, until *budget blocks
+ * have been freed. depth is 1 if it points at data blocks, first is the file block of its first entry. The entries
+ * of the freed blocks are cleared, and the indirect block is written back if it is kept. *end is lowered to the
+ * first file block freed. Returns 1 if the indirect block was freed, 0 if it is kept (*budget is then 0).*/
+static int freeIndirect(int blockNum, int depth, long first, int *budget, long *end) {
+  int perBlock = blockBytes / (int) sizeof(int);
+  long span = 1;//file blocks under each entry
+  for (int d = 1; d < depth; ++d)
+    span *= perBlock;
+  int buf[perBlock];
+  cache_read(blockNum, 1, buf);
+  int changed = 0;
+  int entry;
+  for (entry = perBlock - 1; entry >= 0 && *budget > 0; --entry) {
+    if (buf[entry] <= 0) continue;//no block allocated
+    if (depth > 1) {
+      if (!freeIndirect(buf[entry], depth - 1, first + entry * span, budget, end)) break;
+    } else {
+      freeBlk(buf[entry]);
+      --*budget;
+      *end = first + entry;
+    }
+    buf[entry] = 0;
+    changed = 1;
+  }
+  if (entry < 0 && *budget > 0) {//nothing left under it
+    freeBlk(blockNum);
+    --*budget;
+    return 1;
+  }
+  if (changed)
+    meta_write(blockNum, 1, buf);
+  return 0;
+}
+
+/*Removes a file from the filesystem. Returns 0 on success, -1 on failure.*/
 int sfs_remove(char *file) {
+  if (!mounted) return -1;
+  long blocks = stat_callBegin(SFS_CALL_REMOVE);
+  pthread_rwlock_wrlock(&dirLock);
+  txn_begin();
+  int result = file_remove(file);
+  txn_end();
+  pthread_rwlock_unlock(&dirLock);
+  stat_callEnd(SFS_CALL_REMOVE, blocks);
+  return result;
+}
+
+/*Does the work of sfs_remove, dirLock (exclusively) and txnLock must be held.
+ * No other thread uses the file's inode: it isn't open and can't be opened.
+ * The remove is a single step if a transaction can hold every block of the free bitmap. Otherwise the file's blocks
+ * are freed from its end, MAX_IO_BLKS per step (see txn_next), and the file is truncated to what it has left after
+ * each step: a crash in between leaves it shorter, never pointing at freed blocks.*/
+static int file_remove(char *file) {
   int dirEntry = dir_find(file);
   if (dirEntry < 0) return -1;
   int inodeID = inodeID_from_dirIndex(dirEntry);
   if (oft_find(inodeID) >= 0) return -1;//if file is open, return error
-  Inode inode = fetchInode(inodeID);
-  //free direct pointer blocks
-  for (int pointer = 0; pointer < 12; ++pointer) {
-    if (inode.pointers[pointer] > 0)//if a block is allocated
-      freeBlk(inode.pointers[pointer]);
-  }
-  //free indirect pointer blocks
-  if (inode.pointers[12] > 0) {//if an indirect block is allocated
-    int buf[BLOCK_BYTES / sizeof(int)];
-    read_blocks(inode.pointers[12], 1, buf);
-    //check each entry
-    for (int indBlkEntry = 0; indBlkEntry < (BLOCK_BYTES / sizeof(int)); ++indBlkEntry) {
-      if (buf[indBlkEntry] > 0)//if a block is allocated
-        freeBlk(buf[indBlkEntry]);
+  Inode *inode = inode_pin(inodeID);//resident until it is freed, even across steps
+  if (inode == NULL) return -1;
+  long perBlock = blockBytes / (long) sizeof(int);
+  long first[3] = {12, 12 + perBlock, 12 + perBlock + perBlock * perBlock};//file block of each indirect pointer
+  int stepBlks = freeMapBlks + 2 <= stepJournalBlks ? INT_MAX : MAX_IO_BLKS;
+  int budget = stepBlks;
+  long end = inode->size / blockBytes + 1;//file blocks from end on are freed
+  for (int pointer = INODE_POINTERS - 1; pointer >= 0; --pointer) {
+    while (inode->pointers[pointer] > 0) {//if a block is allocated
+      if (budget == 0) {//end of a step, the inode no longer points at what it freed
+        if (end * blockBytes < inode->size)
+          inode->size = (int) (end * blockBytes);
+        inode_markDirty(inodeID);
+        txn_next();
+        budget = stepBlks;
+      }
+      if (pointer < 12) {
+        freeBlk(inode->pointers[pointer]);
+        budget--;
+        end = pointer;
+        inode->pointers[pointer] = 0;
+      } else if (freeIndirect(inode->pointers[pointer], pointer - 11, first[pointer - 12], &budget, &end)) {
+        inode->pointers[pointer] = 0;
+      }
     }
-    freeBlk(inode.pointers[12]);
   }
-  //free inode block
-  freeBlk(inodeTbl[inodeID]);
+  inode_unpin(inodeID);
+  inode_drop(inodeID);
   //free inode table entry
-  inodeTbl[inodeID] = 0;
-  inodeTbl_flush();
+  inode_free(inodeID);
   //free dir entry
-  memset(dir[dirEntry], 0, MAX_FNAME_SIZE + sizeof(int));
-  dir_flush();
+  dir_delete(dirEntry);
   return 0;
 }
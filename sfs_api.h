@@ -1,6 +1,44 @@
 #ifndef SFS_API_H
 #define SFS_API_H
-void mksfs(int fresh); // creates the file system
+#define SFS_ALLOC_EXTENT 0 // place a file's blocks in contiguous runs, continuing its previous block (default)
+#define SFS_ALLOC_NEXTFIT 1 // place blocks wherever the allocator's scan finds them first
+#define SFS_FLUSH_DEFERRED 0 // metadata changes stay in memory until sfs_sync/sfs_fsync (default)
+#define SFS_FLUSH_SYNC 1 // every call writes the blocks it changed to disk before returning
+#define SFS_MIN_BLOCK_BYTES 512 // smallest block size sfs_format accepts
+#define SFS_MAX_BLOCK_BYTES 65536 // largest block size sfs_format accepts
+#define SFS_DEFAULT_INODE_BYTES 128 // inode record size formatted by mksfs, a file of up to the record size - 8 bytes is stored in its record
+#define SFS_MAX_ASYNC_REQUESTS 256 // most asynchronous requests pending at once
+#define SFS_CALL_FOPEN 0 // indexes of the API calls counted in SfsStats
+#define SFS_CALL_FCLOSE 1
+#define SFS_CALL_FREAD 2
+#define SFS_CALL_FWRITE 3
+#define SFS_CALL_SEEK 4 // sfs_frseek and sfs_fwseek
+#define SFS_CALL_GETFILESIZE 5
+#define SFS_CALL_GETNEXTFILENAME 6
+#define SFS_CALL_REMOVE 7
+#define SFS_CALL_SYNC 8 // sfs_sync and sfs_fsync
+#define SFS_CALL_FALLOCATE 9
+#define SFS_CALL_COUNT 10
+typedef struct {
+  long calls[SFS_CALL_COUNT]; // calls made to each API function
+  long callBlocks[SFS_CALL_COUNT]; // disk blocks read or written during those calls
+  long bytesRead; // file data returned by sfs_fread
+  long bytesWritten; // file data written by sfs_fwrite
+  long dirLookups; // file names looked up in the directory
+  long allocScans; // free bitmap chunks examined by the block allocator
+  long metadataFlushes; // times the pending metadata was written out
+  long diskReads; // read_blocks requests
+  long diskWrites; // write_blocks requests
+  long blocksRead; // blocks read from the disk
+  long blocksWritten; // blocks written to the disk
+  long cacheHits; // blocks found in the block cache
+  long cacheMisses; // blocks the block cache read from the disk
+} SfsStats; // counters since the last sfs_resetstats
+typedef void (*SfsCallback)(int request, int result, void *arg); // called on a worker thread when a request completes
+// the file calls can be made by several threads at once, mksfs, sfs_format and the sfs_set* calls can't
+int mksfs(int fresh); // creates (fresh != 0, with the default geometry) or mounts the file system, -1 on failure
+int sfs_format(int blockBytes, int blockCount, int maxFiles, int inodeBytes); // creates and mounts a file system with the given geometry
+void sfs_setdisk(const char *imageName); // sets the disk image used by the next mksfs (default "sfs")
 int sfs_getnextfilename(char *fname); // get the name of the next file in directory
 int sfs_getfilesize(const char *path); // get the size of the given file
 int sfs_fopen(char *name); // opens the given file
@@ -10,4 +48,15 @@ int sfs_fwseek(int fileID, int loc); // seek (Write) to the location from beginn
 int sfs_fwrite(int fileID, char *buf, int length); // write buf characters into disk
 int sfs_fread(int fileID, char *buf, int length); // read characters from disk into buf
 int sfs_remove(char *file); // removes a file from the filesystem
+int sfs_sync(); // writes all pending metadata and cached blocks back to disk
+int sfs_fsync(int fileID); // writes the given file's data and metadata back to disk
+int sfs_setflushmode(int mode); // selects when metadata is written (SFS_FLUSH_DEFERRED or SFS_FLUSH_SYNC)
+int sfs_fallocate(int fileID, int offset, int length); // reserves disk blocks for a range of the file
+int sfs_setallocmode(int mode); // selects the block placement policy (SFS_ALLOC_EXTENT or SFS_ALLOC_NEXTFIT)
+int sfs_aread(int fileID, char *buf, int length, SfsCallback callback, void *arg); // starts an sfs_fread, returns a request handle or -1
+int sfs_awrite(int fileID, char *buf, int length, SfsCallback callback, void *arg); // starts an sfs_fwrite, returns a request handle or -1
+int sfs_apoll(int request, int *result); // 1 (and the result) if a request without callback completed, 0 if pending, -1 if unknown
+int sfs_await(int request); // waits for a request without callback and returns its result, -1 if unknown
+SfsStats sfs_stats(); // returns the file system, block cache and disk counters
+void sfs_resetstats(); // sets every counter back to 0
 #endif
\ No newline at end of file
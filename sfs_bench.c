@@ -0,0 +1,269 @@
+/* sfs_bench.c
+ *
+ * Performance benchmark. Each workload times every call it makes and
+ * prints ops/sec, MB/s (for reads and writes), the 50th, 99th and 99.9th
+ * percentile latency in microseconds, and the number of blocks the
+ * disk moved per call (from sfs_stats). The disk is held in memory, so
+ * the numbers reflect the file system rather than the host's storage,
+ * unless a device model is selected with SFS_DISK_MODEL (see disk_emu.h);
+ * the last column is then the device time it modeled per call.
+ *
+ * usage: SFS_Bench [ops per workload (default 2000)]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define BLOCK_BYTES 4096
+#define BLOCK_COUNT 65536          /* 256 MiB disk */
+#define MAX_FILES 1024
+#define FILE_BYTES (64 << 20)      /* file used by the read and write workloads */
+#define MAX_REQUEST_BYTES (1 << 20)
+
+static const int request_sizes[] = {512, 4096, 65536, 1 << 20};
+#define REQUEST_SIZE_COUNT (int)(sizeof(request_sizes) / sizeof(request_sizes[0]))
+
+/* Per-workload measurements. */
+static double *latencies = NULL;   /* seconds, one per call */
+static int samples = 0;
+static double started = 0;
+static int errors = 0;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void workload_begin(void)
+{
+  samples = 0;
+  sfs_resetstats();
+  started = now();
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(double p)
+{
+  int index = (int)(p * samples);
+  if (index >= samples)
+    index = samples - 1;
+  return latencies[index] * 1e6;
+}
+
+/* Prints a row of the results table. bytes is the data moved by the
+ * calls, 0 if the workload doesn't move file data.
+ */
+static void workload_end(const char *name, long bytes)
+{
+  double elapsed = now() - started;
+  SfsStats stats = sfs_stats();
+  DiskStats disk = get_disk_stats();
+  char mbps[16] = "-";
+  if (samples == 0)
+    return;
+  qsort(latencies, samples, sizeof(double), compare_double);
+  if (bytes > 0)
+    snprintf(mbps, sizeof(mbps), "%.1f", bytes / elapsed / (1 << 20));
+  printf("%-18s %7d %11.0f %9s %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, samples,
+         samples / elapsed, mbps, percentile(0.50), percentile(0.99),
+         percentile(0.999),
+         (double)(stats.blocksRead + stats.blocksWritten) / samples,
+         disk.service_us / samples);
+}
+
+static void time_call(double start)
+{
+  latencies[samples++] = now() - start;
+}
+
+static void file_name(char *name, int i)
+{
+  sprintf(name, "bench%05d.dat", i);
+}
+
+static void bench_metadata(int ops)
+{
+  char name[21];
+  int *fds = malloc(sizeof(int) * ops);
+  int i, nfiles = ops < MAX_FILES - 2 ? ops : MAX_FILES - 2;
+  double start;
+
+  workload_begin();
+  for (i = 0; i < nfiles; i++) {
+    file_name(name, i);
+    start = now();
+    fds[i] = sfs_fopen(name);
+    time_call(start);
+    if (fds[i] < 0)
+      errors++;
+  }
+  workload_end("create", 0);
+
+  workload_begin();
+  for (i = 0; i < nfiles; i++) {
+    start = now();
+    if (sfs_fclose(fds[i]) < 0)
+      errors++;
+    time_call(start);
+  }
+  workload_end("close", 0);
+  sfs_sync();
+
+  workload_begin();
+  for (i = 0; i < nfiles; i++) {
+    file_name(name, i);
+    start = now();
+    fds[i] = sfs_fopen(name);
+    time_call(start);
+    if (fds[i] < 0)
+      errors++;
+  }
+  workload_end("open", 0);
+  for (i = 0; i < nfiles; i++)
+    sfs_fclose(fds[i]);
+
+  workload_begin();
+  for (i = 0; i < ops; i++) {
+    file_name(name, i % nfiles);
+    start = now();
+    if (sfs_getfilesize(name) < 0)
+      errors++;
+    time_call(start);
+  }
+  workload_end("getfilesize", 0);
+
+  workload_begin();
+  for (i = 0; i < ops; i++) {
+    start = now();
+    if (sfs_getnextfilename(name) < 0)
+      errors++;
+    time_call(start);
+  }
+  workload_end("getnextfilename", 0);
+
+  workload_begin();
+  for (i = 0; i < nfiles; i++) {
+    file_name(name, i);
+    start = now();
+    if (sfs_remove(name) < 0)
+      errors++;
+    time_call(start);
+  }
+  workload_end("remove", 0);
+  sfs_sync();
+  free(fds);
+}
+
+static void bench_data(int ops, int size, char *buf)
+{
+  char name[32];
+  int fd = sfs_fopen("data.dat");
+  int count = FILE_BYTES / size;
+  int i, pos;
+  double start;
+
+  if (fd < 0) {
+    errors++;
+    return;
+  }
+  if (count > ops)
+    count = ops;
+
+  workload_begin();
+  sfs_fwseek(fd, 0);
+  for (i = 0; i < count; i++) {
+    start = now();
+    if (sfs_fwrite(fd, buf, size) != size)
+      errors++;
+    time_call(start);
+  }
+  sprintf(name, "seq write %d", size);
+  workload_end(name, (long)count * size);
+  sfs_sync();
+
+  workload_begin();
+  sfs_frseek(fd, 0);
+  for (i = 0; i < count; i++) {
+    start = now();
+    if (sfs_fread(fd, buf, size) != size)
+      errors++;
+    time_call(start);
+  }
+  sprintf(name, "seq read %d", size);
+  workload_end(name, (long)count * size);
+
+  workload_begin();
+  for (i = 0; i < ops; i++) {
+    pos = (rand() % count) * size;
+    start = now();
+    sfs_fwseek(fd, pos);
+    if (sfs_fwrite(fd, buf, size) != size)
+      errors++;
+    time_call(start);
+  }
+  sprintf(name, "rand write %d", size);
+  workload_end(name, (long)ops * size);
+  sfs_sync();
+
+  workload_begin();
+  for (i = 0; i < ops; i++) {
+    pos = (rand() % count) * size;
+    start = now();
+    sfs_frseek(fd, pos);
+    if (sfs_fread(fd, buf, size) != size)
+      errors++;
+    time_call(start);
+  }
+  sprintf(name, "rand read %d", size);
+  workload_end(name, (long)ops * size);
+
+  sfs_fclose(fd);
+  sfs_remove("data.dat");
+  sfs_sync();
+}
+
+int main(int argc, char **argv)
+{
+  int ops = argc > 1 ? atoi(argv[1]) : 2000;
+  char *buf;
+  int i;
+
+  if (ops < 1) {
+    fprintf(stderr, "usage: %s [ops per workload]\n", argv[0]);
+    return 1;
+  }
+  latencies = malloc(sizeof(double) * ops);
+  buf = malloc(MAX_REQUEST_BYTES);
+  if (latencies == NULL || buf == NULL)
+    return 1;
+  memset(buf, 'x', MAX_REQUEST_BYTES);
+
+  set_disk_backend(&RAM_DISK);
+  sfs_setdisk("sfs_bench");
+  if (sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, SFS_DEFAULT_INODE_BYTES) < 0) {
+    fprintf(stderr, "ERROR: format failed\n");
+    return 1;
+  }
+  srand(310);//after sfs_format, opening the disk seeds rand()
+  printf("%-18s %7s %11s %9s %9s %9s %9s %9s %9s\n", "workload", "ops", "ops/s",
+         "MB/s", "p50(us)", "p99(us)", "p999(us)", "blks/op", "disk(us)");
+  bench_metadata(ops);
+  for (i = 0; i < REQUEST_SIZE_COUNT; i++)
+    bench_data(ops, request_sizes[i], buf);
+
+  fprintf(stderr, "Benchmark exiting with %d errors\n", errors);
+  free(latencies);
+  free(buf);
+  return errors != 0;
+}
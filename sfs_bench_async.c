@@ -0,0 +1,171 @@
+/* sfs_bench_async.c
+ *
+ * Asynchronous I/O benchmark. NFILES files are written, then read back
+ * twice with REQUEST_BYTES requests, starting from an empty block cache
+ * each time: once with blocking sfs_fread calls, one file after the
+ * other, and once by submitting every request with sfs_aread up front
+ * and collecting them with sfs_await. The worker threads run requests
+ * on different files at the same time, so on a device that serves
+ * several requests in parallel their disk time overlaps. The device
+ * model is the one selected with SFS_DISK_MODEL (see disk_emu.h), the
+ * ssd model if none is. The output shows the time taken, the
+ * throughput and the modeled device time of both passes.
+ *
+ * usage: AsyncBench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block_cache.h"
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define BLOCK_BYTES 4096
+#define BLOCK_COUNT 16384          /* 64 MiB disk */
+#define MAX_FILES 64
+#define NFILES 8
+#define FILE_BYTES (2 << 20)
+#define REQUEST_BYTES (64 << 10)
+#define REQUESTS_PER_FILE (FILE_BYTES / REQUEST_BYTES)
+
+static int fds[NFILES];
+static int errors = 0;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char file_byte(int file, long i)
+{
+  return (char)(i / BLOCK_BYTES + file);
+}
+
+/* Drops every cached block, so the next pass reads from the disk. */
+static void cache_empty(void)
+{
+  sfs_sync();
+  if (cache_setCapacity(cache_getCapacity()) < 0)
+    errors++;
+  reset_disk_stats();
+}
+
+static void check_data(const char *data)
+{
+  int file;
+  long i;
+
+  for (file = 0; file < NFILES; file++) {
+    for (i = 0; i < FILE_BYTES; i += BLOCK_BYTES) {
+      if (data[(long)file * FILE_BYTES + i] != file_byte(file, i)) {
+        fprintf(stderr, "ERROR: wrong data read from file %d at %ld\n", file, i);
+        errors++;
+        return;
+      }
+    }
+  }
+}
+
+static void print_pass(const char *name, double seconds, double base)
+{
+  DiskStats disk = get_disk_stats();
+
+  printf("%-10s %9.3f %9.1f %12.0f %10ld %8.2fx\n", name, seconds,
+         (double)NFILES * FILE_BYTES / (1 << 20) / seconds,
+         disk.service_us / 1000, disk.reads, base / seconds);
+}
+
+static double read_blocking(char *data)
+{
+  double start;
+  int file, i;
+
+  cache_empty();
+  start = now();
+  for (file = 0; file < NFILES; file++) {
+    sfs_frseek(fds[file], 0);
+    for (i = 0; i < REQUESTS_PER_FILE; i++) {
+      if (sfs_fread(fds[file], data + (long)file * FILE_BYTES + (long)i * REQUEST_BYTES,
+                    REQUEST_BYTES) != REQUEST_BYTES)
+        errors++;
+    }
+  }
+  return now() - start;
+}
+
+static double read_async(char *data)
+{
+  int requests[NFILES * REQUESTS_PER_FILE];
+  double start;
+  int file, i;
+
+  cache_empty();
+  start = now();
+  for (file = 0; file < NFILES; file++)
+    sfs_frseek(fds[file], 0);
+  /* requests on one file run in order, the files are read side by side */
+  for (i = 0; i < REQUESTS_PER_FILE; i++) {
+    for (file = 0; file < NFILES; file++) {
+      requests[i * NFILES + file] = sfs_aread(fds[file],
+          data + (long)file * FILE_BYTES + (long)i * REQUEST_BYTES, REQUEST_BYTES, NULL, NULL);
+    }
+  }
+  for (i = 0; i < NFILES * REQUESTS_PER_FILE; i++) {
+    if (requests[i] < 0 || sfs_await(requests[i]) != REQUEST_BYTES)
+      errors++;
+  }
+  return now() - start;
+}
+
+int main(void)
+{
+  char *data = malloc((long)NFILES * FILE_BYTES);
+  char name[21];
+  double blocking, async;
+  int file;
+  long i;
+
+  if (data == NULL)
+    return 1;
+  set_disk_backend(&RAM_DISK);
+  sfs_setdisk("bench_async");
+  if (sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, SFS_DEFAULT_INODE_BYTES) < 0) {
+    fprintf(stderr, "ERROR: format failed\n");
+    return 1;
+  }
+  for (file = 0; file < NFILES; file++) {
+    for (i = 0; i < FILE_BYTES; i++)
+      data[i] = file_byte(file, i);
+    sprintf(name, "async%d.dat", file);
+    fds[file] = sfs_fopen(name);
+    if (fds[file] < 0 || sfs_fwrite(fds[file], data, FILE_BYTES) != FILE_BYTES) {
+      fprintf(stderr, "ERROR: could not write %s\n", name);
+      return 1;
+    }
+  }
+  if (getenv("SFS_DISK_MODEL") == NULL)
+    set_disk_model(&SSD_MODEL);
+
+  printf("model: %s, %d files of %d KiB, %d KiB requests\n", get_disk_model()->name,
+         NFILES, FILE_BYTES >> 10, REQUEST_BYTES >> 10);
+  printf("%-10s %9s %9s %12s %10s %9s\n", "pass", "seconds", "MB/s", "device(ms)",
+         "requests", "speedup");
+  memset(data, 0, (long)NFILES * FILE_BYTES);
+  blocking = read_blocking(data);
+  check_data(data);
+  print_pass("blocking", blocking, blocking);
+  memset(data, 0, (long)NFILES * FILE_BYTES);
+  async = read_async(data);
+  check_data(data);
+  print_pass("async", async, blocking);
+
+  for (file = 0; file < NFILES; file++)
+    sfs_fclose(fds[file]);
+  fprintf(stderr, "Benchmark exiting with %d errors\n", errors);
+  free(data);
+  return errors != 0;
+}
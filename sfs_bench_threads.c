@@ -0,0 +1,123 @@
+/* sfs_bench_threads.c
+ *
+ * Multi-threaded throughput benchmark. Every thread streams its own
+ * file: it writes FILE_BYTES in CHUNK_BYTES chunks, then reads the file
+ * back READ_PASSES times. The same per-thread work is run with 1, 2,
+ * 4, ... threads (up to the count given on the command line, default 8)
+ * and the aggregate throughput is printed for each, so the scaling of
+ * independent file I/O with the thread count can be compared. The disk
+ * is held in memory so that the host's storage doesn't dominate.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define BLOCK_BYTES 4096
+#define BLOCK_COUNT 65536      /* 256 MiB disk */
+#define MAX_FILES 256
+#define FILE_BYTES (16 << 20)  /* written by each thread */
+#define CHUNK_BYTES 4096       /* size of each sfs_fwrite / sfs_fread */
+#define READ_PASSES 4
+#define MAX_THREADS 64
+
+static int errors = 0;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void report_error(const char *what, int thread)
+{
+  pthread_mutex_lock(&error_lock);
+  fprintf(stderr, "ERROR: %s (thread %d)\n", what, thread);
+  errors++;
+  pthread_mutex_unlock(&error_lock);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg)
+{
+  int thread = (int)(long)arg;
+  char name[21];
+  char *chunk = malloc(CHUNK_BYTES);
+  char *expected = malloc(CHUNK_BYTES);
+  int fd, pos, pass;
+
+  sprintf(name, "bench%d.dat", thread);
+  fd = sfs_fopen(name);
+  if (fd < 0) {
+    report_error("open failed", thread);
+    free(chunk);
+    free(expected);
+    return NULL;
+  }
+  for (pos = 0; pos < FILE_BYTES; pos += CHUNK_BYTES) {
+    memset(chunk, 'A' + (pos / CHUNK_BYTES + thread) % 26, CHUNK_BYTES);
+    if (sfs_fwrite(fd, chunk, CHUNK_BYTES) != CHUNK_BYTES) {
+      report_error("short write", thread);
+      break;
+    }
+  }
+  for (pass = 0; pass < READ_PASSES; pass++) {
+    sfs_frseek(fd, 0);
+    for (pos = 0; pos < FILE_BYTES; pos += CHUNK_BYTES) {
+      if (sfs_fread(fd, chunk, CHUNK_BYTES) != CHUNK_BYTES) {
+        report_error("short read", thread);
+        break;
+      }
+      memset(expected, 'A' + (pos / CHUNK_BYTES + thread) % 26, CHUNK_BYTES);
+      if (memcmp(chunk, expected, CHUNK_BYTES) != 0) {
+        report_error("wrong data read", thread);
+        break;
+      }
+    }
+  }
+  sfs_fclose(fd);
+  sfs_remove(name);
+  free(chunk);
+  free(expected);
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t threads[MAX_THREADS];
+  int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+  int nthreads, i;
+  double base = 0;
+
+  if (max_threads < 1 || max_threads > MAX_THREADS) {
+    fprintf(stderr, "usage: %s [threads (1-%d)]\n", argv[0], MAX_THREADS);
+    return 1;
+  }
+  set_disk_backend(&RAM_DISK);
+  sfs_setdisk("bench_threads");
+  if (sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, SFS_DEFAULT_INODE_BYTES) < 0) {
+    fprintf(stderr, "ERROR: format failed\n");
+    return 1;
+  }
+  printf("%-8s %10s %10s %8s\n", "threads", "seconds", "MB/s", "speedup");
+  for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+    double start = now(), seconds, mbps;
+    for (i = 0; i < nthreads; i++)
+      pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+    for (i = 0; i < nthreads; i++)
+      pthread_join(threads[i], NULL);
+    seconds = now() - start;
+    mbps = (double)nthreads * FILE_BYTES * (1 + READ_PASSES) / (1 << 20) / seconds;
+    if (nthreads == 1)
+      base = mbps;
+    printf("%-8d %10.3f %10.1f %7.2fx\n", nthreads, seconds, mbps, mbps / base);
+    sfs_sync();
+  }
+  fprintf(stderr, "Benchmark exiting with %d errors\n", errors);
+  return errors != 0;
+}
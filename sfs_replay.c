@@ -0,0 +1,185 @@
+/* sfs_replay.c
+ *
+ * Replays a block I/O trace (see start_disk_trace in disk_emu.h) against
+ * a fresh disk image: every recorded read and write is issued again with
+ * read_blocks/write_blocks, on an image re-created whenever the trace
+ * opened a disk of a different geometry. By default the requests are
+ * issued back to back; with -t they are spaced as they were recorded.
+ * The disk backend and device model are chosen as usual (set them with
+ * SFS_DISK_BACKEND and SFS_DISK_MODEL), so a captured access pattern can
+ * be timed against any of them. Prints the time taken and the latency
+ * of the requests, overall and for each API call that made them.
+ *
+ * usage: TraceReplay [-t] trace
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define IMAGE_NAME "sfs_replay"
+
+static const char *call_names[SFS_CALL_COUNT] = {
+  "fopen", "fclose", "fread", "fwrite", "seek", "getfilesize",
+  "getnextfilename", "remove", "sync", "fallocate"
+};
+
+/* Latencies (seconds) of the requests replayed for one origin. */
+typedef struct {
+  double *latencies;
+  long count;
+  long capacity;
+  long blocks;
+  double total;
+} Origin;
+
+static Origin origins[TRACE_NO_ORIGIN + 1];
+static Origin all;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record_latency(Origin *origin, double latency, int nblocks)
+{
+  if (origin->count == origin->capacity) {
+    origin->capacity = origin->capacity ? origin->capacity * 2 : 1024;
+    origin->latencies = realloc(origin->latencies, sizeof(double) * origin->capacity);
+    if (origin->latencies == NULL) {
+      fprintf(stderr, "ERROR: out of memory\n");
+      exit(1);
+    }
+  }
+  origin->latencies[origin->count++] = latency;
+  origin->blocks += nblocks;
+  origin->total += latency;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const Origin *origin, double p)
+{
+  long index = (long)(p * origin->count);
+  if (index >= origin->count)
+    index = origin->count - 1;
+  return origin->latencies[index] * 1e6;
+}
+
+static void print_origin(const char *name, Origin *origin)
+{
+  if (origin->count == 0)
+    return;
+  qsort(origin->latencies, origin->count, sizeof(double), compare_double);
+  printf("%-16s %9ld %10ld %11.2f %9.2f %9.2f %9.2f\n", name, origin->count,
+         origin->blocks, origin->total / origin->count * 1e6,
+         percentile(origin, 0.50), percentile(origin, 0.99),
+         percentile(origin, 0.999));
+}
+
+/* Opens the disk of a TRACE_OPEN record, re-creating the image if its
+ * geometry changed. Returns 0 on success, -1 on failure. */
+static int open_disk(const TraceRecord *record, int *block_size, int *block_count)
+{
+  if (record->nblocks == *block_size && record->start == *block_count)
+    return init_disk(IMAGE_NAME, *block_size, *block_count);
+  *block_size = record->nblocks;
+  *block_count = record->start;
+  return init_fresh_disk(IMAGE_NAME, *block_size, *block_count);
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = argc > 1 ? argv[argc - 1] : NULL;
+  int timed = argc == 3 && strcmp(argv[1], "-t") == 0;
+  char magic[sizeof(TRACE_MAGIC)];
+  TraceRecord record;
+  int block_size = 0, block_count = 0, errors = 0, i;
+  long buffer_bytes = 0;
+  char *buffer = NULL;
+  double trace_time = 0, started, elapsed, start;
+  FILE *trace;
+
+  if (path == NULL || argc > 3 || (argc == 3 && !timed)) {
+    fprintf(stderr, "usage: %s [-t] trace\n", argv[0]);
+    return 1;
+  }
+  trace = fopen(path, "rb");
+  if (trace == NULL || fread(magic, 1, strlen(TRACE_MAGIC), trace) != strlen(TRACE_MAGIC)
+      || memcmp(magic, TRACE_MAGIC, strlen(TRACE_MAGIC)) != 0) {
+    fprintf(stderr, "ERROR: %s is not a block I/O trace\n", path);
+    return 1;
+  }
+
+  started = now();
+  while (fread(&record, sizeof(record), 1, trace) == 1) {
+    trace_time += record.delta_us / 1e6;
+    if (record.op == TRACE_OPEN) {
+      if (open_disk(&record, &block_size, &block_count) < 0) {
+        fprintf(stderr, "ERROR: could not open a disk of %d blocks of %d bytes\n",
+                record.start, record.nblocks);
+        return 1;
+      }
+      continue;
+    }
+    if (block_size == 0 || record.op > TRACE_WRITE) {
+      errors++;
+      continue;
+    }
+    if ((long)record.nblocks * block_size > buffer_bytes) {
+      buffer_bytes = (long)record.nblocks * block_size;
+      buffer = realloc(buffer, buffer_bytes);
+      if (buffer == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        return 1;
+      }
+      memset(buffer, 0xA5, buffer_bytes);
+    }
+    if (timed) {
+      double wait = started + trace_time - now();
+      if (wait > 0) {
+        struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+        nanosleep(&ts, NULL);
+      }
+    }
+    start = now();
+    if (record.op == TRACE_READ)
+      errors += read_blocks(record.start, record.nblocks, buffer) < 0;
+    else
+      errors += write_blocks(record.start, record.nblocks, buffer) < 0;
+    elapsed = now() - start;
+    record_latency(&all, elapsed, record.nblocks);
+    record_latency(&origins[record.origin], elapsed, record.nblocks);
+  }
+  sync_disk();
+  elapsed = now() - started;
+  close_disk();
+  fclose(trace);
+
+  printf("replayed %ld requests (%ld blocks) in %.3f s, recorded in %.3f s\n",
+         all.count, all.blocks, elapsed, trace_time);
+  printf("%-16s %9s %10s %11s %9s %9s %9s\n", "origin", "requests", "blocks",
+         "mean(us)", "p50(us)", "p99(us)", "p999(us)");
+  for (i = 0; i < SFS_CALL_COUNT; i++)
+    print_origin(call_names[i], &origins[i]);
+  for (i = SFS_CALL_COUNT; i < TRACE_NO_ORIGIN; i++) {
+    char name[16];
+    sprintf(name, "tag %d", i);
+    print_origin(name, &origins[i]);
+  }
+  print_origin("(untagged)", &origins[TRACE_NO_ORIGIN]);
+  print_origin("all", &all);
+
+  fprintf(stderr, "Replay exiting with %d errors\n", errors);
+  free(buffer);
+  return errors != 0;
+}
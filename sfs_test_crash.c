@@ -0,0 +1,319 @@
+/* sfs_test_crash.c
+ *
+ * Crash consistency test. Each case formats a disk image holding a
+ * synced file, then a child process mounts it, removes or truncates the
+ * file (truncation is a remove and re-create, as SFS_Fuse does it),
+ * maybe writes other files, and crashes with _exit before unmounting.
+ * The image is then mounted again, which replays the journal, and every
+ * file that exists must hold exactly the data of one of its versions:
+ * a crash may lose changes that weren't synced, never corrupt a file.
+ * The disk is nearly full, so the child can only write other files in
+ * the blocks "old" had, and its block cache is small enough that it
+ * evicts blocks (and commits transactions) in the middle of its work.
+ * The last case uses a larger disk, and the child crashes in the middle
+ * of a single multi-MiB append: the big file must keep its synced data
+ * and at most the part of the append that committed, and none of its
+ * blocks may be handed out again to a file written after the crash.
+ * First, mounting an image that doesn't exist must fail, and so must
+ * every call made while nothing is mounted.
+ *
+ * usage: CrashTest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "block_cache.h"
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define IMAGE_NAME "crash_test"
+#define BLOCK_BYTES 1024
+#define BLOCK_COUNT 4096
+#define MAX_FILES 64
+#define CACHE_BLOCKS 64        /* small enough for the child to evict and commit as it goes */
+#define OLD_BYTES (200 << 10)
+#define NEW_BYTES (10 << 10)
+#define OTHER_BYTES (400 << 10)
+#define FILLER_BYTES (3360 << 10) /* leaves about 250 KiB free, so OTHER_BYTES need the blocks of "old" */
+#define BIG_BLOCK_COUNT 65536
+#define BIG_MAX_FILES 16
+#define BIG_BYTES (20 << 20)
+#define AFTER_BYTES (8 << 20)  /* written to each file after the crash */
+#define CRASH_WRITES (BIG_BYTES / BLOCK_BYTES / 2) /* write requests of the append before the crash */
+
+static char *data;
+static int errors = 0;
+static const DiskBackend *real_disk;
+static DiskBackend crashing_disk;  /* real_disk, with writes that stop when the child crashes */
+static long writes_left = -1;      /* the child crashes when this reaches 0, never if negative */
+
+static int crashing_write(long offset, long length, void *buffer)
+{
+  if (writes_left == 0)
+    _exit(0);  /* as if the power went out before this request */
+  if (writes_left > 0)
+    writes_left--;
+  return real_disk->write(offset, length, buffer);
+}
+
+static char file_byte(char version, int i)
+{
+  return (char)(version + i / BLOCK_BYTES);
+}
+
+/* Creates (or re-creates) a file holding size bytes of the given version. */
+static int write_file(const char *name, char version, int size)
+{
+  int fd, i;
+
+  sfs_remove((char *)name);
+  fd = sfs_fopen((char *)name);
+  if (fd < 0)
+    return -1;
+  for (i = 0; i < size; i++)
+    data[i] = file_byte(version, i);
+  if (sfs_fwrite(fd, data, size) != size)
+    return -1;
+  return sfs_fclose(fd);
+}
+
+/* Returns 1 if the file holds size bytes of the version (or, if partial,
+ * at most size bytes of it), 0 if it holds something else. */
+static int file_matches(const char *name, char version, int size, int partial)
+{
+  int fd, i;
+
+  if (size < 0 || (partial ? sfs_getfilesize(name) > size : sfs_getfilesize(name) != size))
+    return 0;
+  size = sfs_getfilesize(name);
+  fd = sfs_fopen((char *)name);
+  if (fd < 0 || sfs_fread(fd, data, size) != size) {
+    sfs_fclose(fd);
+    return 0;
+  }
+  sfs_fclose(fd);
+  for (i = 0; i < size; i++) {
+    if (data[i] != file_byte(version, i))
+      return 0;
+  }
+  return 1;
+}
+
+/* Checks a file after the crash. It may be missing only if may_be_gone,
+ * otherwise it must hold size bytes of version, or the start of the
+ * new_size bytes of new_version written by the child (-1 for neither). */
+static void check_file(const char *test, const char *name, int may_be_gone,
+                       char version, int size, char new_version, int new_size)
+{
+  if (sfs_getfilesize(name) < 0) {
+    if (!may_be_gone) {
+      fprintf(stderr, "ERROR: %s: %s is gone\n", test, name);
+      errors++;
+    }
+    return;
+  }
+  if (!file_matches(name, version, size, 0) && !file_matches(name, new_version, new_size, 1)) {
+    fprintf(stderr, "ERROR: %s: %s holds neither version (%d bytes)\n", test, name,
+            sfs_getfilesize(name));
+    errors++;
+  }
+}
+
+/* Runs the steps of a case in a child process, which crashes at the end. */
+static void run_crashed(const char *test, void (*steps)(void))
+{
+  int status;
+  pid_t child = fork();
+
+  if (child == 0) {
+    mksfs(0);
+    cache_setCapacity(CACHE_BLOCKS);
+    steps();
+    _exit(0);//no unmount: whatever is still cached is lost
+  }
+  if (child < 0 || waitpid(child, &status, 0) < 0 || !WIFEXITED(status)) {
+    fprintf(stderr, "ERROR: %s: the child process failed\n", test);
+    errors++;
+  } else if (WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "ERROR: %s: the child finished before it crashed\n", test);
+    errors++;
+  }
+  mksfs(0);
+}
+
+/* Formats the image with a synced file "old" of OLD_BYTES, and a filler
+ * file taking most of the remaining space. */
+static void setup(void)
+{
+  if (sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, SFS_DEFAULT_INODE_BYTES) < 0
+      || write_file("old", 'a', OLD_BYTES) < 0 || write_file("filler", 'f', FILLER_BYTES) < 0
+      || sfs_sync() < 0) {
+    fprintf(stderr, "ERROR: setup failed\n");
+    exit(1);
+  }
+}
+
+/* Mounts an image that doesn't exist, the calls made afterwards must fail
+ * without touching the structures of a file system. */
+static void check_unmounted(void)
+{
+  char name[21];
+  int fd;
+
+  sfs_setdisk("missing_dir/" IMAGE_NAME);
+  if (mksfs(0) == 0) {
+    fprintf(stderr, "ERROR: mounted an image that doesn't exist\n");
+    errors++;
+  }
+  fd = sfs_fopen("a");
+  if (fd >= 0 || sfs_getfilesize("a") >= 0 || sfs_getnextfilename(name) == 0
+      || sfs_fwrite(0, name, 1) > 0 || sfs_fread(0, name, 1) > 0 || sfs_frseek(0, 0) == 0
+      || sfs_fwseek(0, 0) == 0 || sfs_fsync(0) == 0 || sfs_fallocate(0, 0, 1) == 0
+      || sfs_fclose(0) == 0 || sfs_remove("a") == 0 || sfs_sync() == 0) {
+    fprintf(stderr, "ERROR: a call succeeded with nothing mounted\n");
+    errors++;
+  }
+  sfs_setdisk(IMAGE_NAME);
+}
+
+static void remove_old(void)
+{
+  sfs_remove("old");
+}
+
+static void remove_old_synced(void)
+{
+  sfs_remove("old");
+  sfs_sync();
+}
+
+/* The blocks freed by the remove must not be reused before it commits */
+static void remove_old_write_other(void)
+{
+  sfs_remove("old");
+  write_file("other", 'b', OTHER_BYTES);
+}
+
+static void truncate_old(void)
+{
+  write_file("old", 'c', NEW_BYTES);
+}
+
+static void truncate_old_write_other(void)
+{
+  write_file("old", 'c', NEW_BYTES);
+  write_file("other", 'b', OTHER_BYTES);
+}
+
+static void truncate_old_synced(void)
+{
+  write_file("old", 'c', NEW_BYTES);
+  write_file("other", 'b', OTHER_BYTES);
+  sfs_sync();
+}
+
+/* Formats the larger image with a synced file "big" of BIG_BYTES. */
+static void setup_big(void)
+{
+  if (sfs_format(BLOCK_BYTES, BIG_BLOCK_COUNT, BIG_MAX_FILES, SFS_DEFAULT_INODE_BYTES) < 0
+      || write_file("big", 'g', BIG_BYTES) < 0 || sfs_sync() < 0) {
+    fprintf(stderr, "ERROR: setup failed\n");
+    exit(1);
+  }
+}
+
+/* Appends BIG_BYTES more to "big" with one call, crashing halfway. */
+static void append_big(void)
+{
+  int fd = sfs_fopen("big");
+  int i;
+
+  for (i = 0; i < BIG_BYTES; i++)
+    data[i] = file_byte('g', BIG_BYTES + i);
+  sfs_fwseek(fd, BIG_BYTES);
+  writes_left = CRASH_WRITES;
+  sfs_fwrite(fd, data, BIG_BYTES);
+  _exit(1);
+}
+
+/* Appends AFTER_BYTES to "big" after the crash, then checks it along with
+ * "other", which was written in between. */
+static void append_big_after(void)
+{
+  int size = sfs_getfilesize("big");
+  int fd = sfs_fopen("big");
+  int i;
+
+  for (i = 0; i < AFTER_BYTES; i++)
+    data[i] = file_byte('g', size + i);
+  sfs_fwseek(fd, size);
+  if (fd < 0 || sfs_fwrite(fd, data, AFTER_BYTES) != AFTER_BYTES) {
+    fprintf(stderr, "ERROR: append, crash: could not append to big after the crash\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+  check_file("append, crash", "big", 0, 'g', size + AFTER_BYTES, 0, -1);
+  check_file("append, crash", "other", 0, 'b', AFTER_BYTES, 0, -1);
+}
+
+int main(void)
+{
+  data = malloc(3 * BIG_BYTES);
+  if (data == NULL)
+    return 1;
+  real_disk = get_disk_backend();
+  crashing_disk = *real_disk;
+  crashing_disk.write = crashing_write;
+  set_disk_backend(&crashing_disk);
+  check_unmounted();
+
+  setup();
+  run_crashed("remove", remove_old);
+  check_file("remove", "old", 1, 'a', OLD_BYTES, 0, -1);
+
+  setup();
+  run_crashed("remove, sync", remove_old_synced);
+  if (sfs_getfilesize("old") >= 0) {
+    fprintf(stderr, "ERROR: remove, sync: old is still there\n");
+    errors++;
+  }
+
+  setup();
+  run_crashed("remove, write", remove_old_write_other);
+  check_file("remove, write", "old", 1, 'a', OLD_BYTES, 0, -1);
+  check_file("remove, write", "other", 1, 0, -1, 'b', OTHER_BYTES);
+
+  setup();
+  run_crashed("truncate", truncate_old);
+  check_file("truncate", "old", 1, 'a', OLD_BYTES, 'c', NEW_BYTES);
+
+  setup();
+  run_crashed("truncate, write", truncate_old_write_other);
+  check_file("truncate, write", "old", 1, 'a', OLD_BYTES, 'c', NEW_BYTES);
+  check_file("truncate, write", "other", 1, 0, -1, 'b', OTHER_BYTES);
+
+  setup();
+  run_crashed("truncate, sync", truncate_old_synced);
+  check_file("truncate, sync", "old", 0, 'c', NEW_BYTES, 0, -1);
+  check_file("truncate, sync", "other", 0, 'b', OTHER_BYTES, 0, -1);
+
+  setup_big();
+  run_crashed("append, crash", append_big);
+  if (sfs_getfilesize("big") < BIG_BYTES) {
+    fprintf(stderr, "ERROR: append, crash: big lost its synced data\n");
+    errors++;
+  }
+  check_file("append, crash", "big", 0, 'g', BIG_BYTES, 'g', 2 * BIG_BYTES);
+  if (write_file("other", 'b', AFTER_BYTES) < 0) {
+    fprintf(stderr, "ERROR: append, crash: could not write other after the crash\n");
+    errors++;
+  }
+  append_big_after();
+
+  fprintf(stderr, "Crash test exiting with %d errors\n", errors);
+  free(data);
+  return errors != 0;
+}
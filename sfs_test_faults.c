@@ -0,0 +1,162 @@
+/* sfs_test_faults.c
+ *
+ * Disk failure test. A few files are written on a reliable disk, then
+ * the device model is switched to one where every request fails with
+ * probability FAILURE_P and is never retried, and parts of the files
+ * are overwritten and read back. A call may fail or fall short, but
+ * what it reports must be true: every byte sfs_fwrite counted as
+ * written must be read back, every other byte must hold its old or its
+ * new value, and sfs_fread must never return more than it read. The
+ * block cache is small, so blocks are evicted (and their write-back
+ * fails) in the middle of the calls. At the end the disk is made
+ * reliable again, synced and mounted again, and every file is checked.
+ *
+ * usage: FaultTest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_cache.h"
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define BLOCK_BYTES 1024
+#define BLOCK_COUNT 8192
+#define MAX_FILES 32
+#define CACHE_BLOCKS 32        /* small enough to evict in the middle of a call */
+#define NFILES 8
+#define FILE_BYTES (64 << 10)
+#define MAX_CHUNK 9000
+#define ROUNDS 400
+#define FAILURE_P 0.2
+
+static const DiskModel FAILING = {"failing", 0, 0, 0, 0, 1, FAILURE_P, 0, 0};
+
+static int fds[NFILES];
+static char written[NFILES][FILE_BYTES]; /* 1 for each byte sfs_fwrite reported as overwritten */
+static int errors = 0;
+
+static char old_byte(int file, int i)
+{
+  return (char)(i * 3 + file);
+}
+
+static char new_byte(int file, int i)
+{
+  return (char)(i * 3 + file + 101);
+}
+
+/* Checks length bytes read from offset of a file. */
+static void check_data(const char *what, int file, int offset, const char *data, int length)
+{
+  int i;
+
+  for (i = 0; i < length; i++) {
+    char c = data[i];
+    if (written[file][offset + i] ? c != new_byte(file, offset + i)
+        : c != old_byte(file, offset + i) && c != new_byte(file, offset + i)) {
+      fprintf(stderr, "ERROR: %s: wrong data in file %d at %d\n", what, file, offset + i);
+      errors++;
+      return;
+    }
+  }
+}
+
+int main(void)
+{
+  char *buf = malloc(FILE_BYTES);
+  char name[21];
+  int file, i, round, offset, length, got, failed_calls = 0;
+
+  if (buf == NULL)
+    return 1;
+  set_disk_backend(&RAM_DISK);
+  sfs_setdisk("test_faults");
+  if (sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, SFS_DEFAULT_INODE_BYTES) < 0
+      || cache_setCapacity(CACHE_BLOCKS) < 0) {
+    fprintf(stderr, "ERROR: format failed\n");
+    return 1;
+  }
+  for (file = 0; file < NFILES; file++) {
+    for (i = 0; i < FILE_BYTES; i++)
+      buf[i] = old_byte(file, i);
+    sprintf(name, "fault%d", file);
+    fds[file] = sfs_fopen(name);
+    if (fds[file] < 0 || sfs_fwrite(fds[file], buf, FILE_BYTES) != FILE_BYTES) {
+      fprintf(stderr, "ERROR: could not write %s\n", name);
+      return 1;
+    }
+  }
+  if (sfs_sync() < 0) {
+    fprintf(stderr, "ERROR: sync failed\n");
+    return 1;
+  }
+
+  set_disk_model(&FAILING);
+  reset_disk_stats();
+  for (round = 0; round < ROUNDS; round++) {
+    file = round % NFILES;
+    length = 1 + (round * 7919) % MAX_CHUNK;
+    offset = (round * 104729) % (FILE_BYTES - length);
+    for (i = 0; i < length; i++)
+      buf[i] = new_byte(file, offset + i);
+    sfs_fwseek(fds[file], offset);
+    got = sfs_fwrite(fds[file], buf, length);
+    if (got < -1 || got > length) {
+      fprintf(stderr, "ERROR: sfs_fwrite returned %d for %d bytes\n", got, length);
+      errors++;
+    } else if (got > 0) {
+      memset(&written[file][offset], 1, got);
+    }
+    failed_calls += got < length;
+
+    sfs_frseek(fds[file], offset);
+    got = sfs_fread(fds[file], buf, length);
+    if (got < -1 || got > length) {
+      fprintf(stderr, "ERROR: sfs_fread returned %d for %d bytes\n", got, length);
+      errors++;
+    } else if (got > 0) {
+      check_data("read", file, offset, buf, got);
+    }
+    failed_calls += got < length;
+    sprintf(name, "fault%d", file);
+    if (sfs_getfilesize(name) != FILE_BYTES) {
+      fprintf(stderr, "ERROR: the size of %s changed\n", name);
+      errors++;
+    }
+    if (round % 50 == 0)
+      sfs_fsync(fds[file]);
+  }
+  if (get_disk_stats().failures == 0 || failed_calls == 0) {
+    fprintf(stderr, "ERROR: no request failed, nothing was tested\n");
+    errors++;
+  }
+
+  set_disk_model(&NO_LATENCY);
+  for (file = 0; file < NFILES; file++)
+    sfs_fclose(fds[file]);
+  if (sfs_sync() < 0) {
+    fprintf(stderr, "ERROR: sync failed on a reliable disk\n");
+    errors++;
+  }
+  if (mksfs(0) < 0) {
+    fprintf(stderr, "ERROR: could not mount the disk again\n");
+    return 1;
+  }
+  for (file = 0; file < NFILES; file++) {
+    sprintf(name, "fault%d", file);
+    fds[file] = sfs_fopen(name);
+    if (sfs_getfilesize(name) != FILE_BYTES || sfs_fread(fds[file], buf, FILE_BYTES) != FILE_BYTES) {
+      fprintf(stderr, "ERROR: could not read %s after mounting again\n", name);
+      errors++;
+      continue;
+    }
+    check_data("after mounting again", file, 0, buf, FILE_BYTES);
+    sfs_fclose(fds[file]);
+  }
+
+  fprintf(stderr, "Fault test exiting with %d errors\n", errors);
+  free(buf);
+  return errors != 0;
+}
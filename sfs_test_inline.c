@@ -0,0 +1,133 @@
+/* sfs_test_inline.c
+ *
+ * Inline file test. The disk is formatted with INODE_BYTES inode
+ * records, so that a file of INLINE_FILE_BYTES is stored in its inode
+ * record rather than in a data block. The file is written in pieces,
+ * read back, checked to be in the record of its inode in the inode
+ * table, then grown past the record (which moves it to a data block)
+ * and read back again, before and after mounting the disk again.
+ * sfs_format must also refuse inode record sizes it can't lay out.
+ *
+ * usage: InlineTest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define BLOCK_BYTES 4096
+#define BLOCK_COUNT 1024
+#define MAX_FILES 16
+#define INODE_BYTES 2048
+#define INLINE_FILE_BYTES 1024
+#define GROWN_FILE_BYTES 6000
+#define INODE_TABLE_BLOCK 1      /* the inode table starts after the super block */
+#define FILE_INODE 1             /* the first file created, after the root directory */
+
+static int errors = 0;
+
+static char file_byte(int i)
+{
+  return (char)(i * 7 + 3);
+}
+
+/* Reads the whole file back and checks its size and data. */
+static void check_file(const char *what, const char *name, int size)
+{
+  char data[GROWN_FILE_BYTES];
+  int fd, i, got;
+
+  if (sfs_getfilesize(name) != size) {
+    fprintf(stderr, "ERROR: %s: size %d, expected %d\n", what, sfs_getfilesize(name), size);
+    errors++;
+    return;
+  }
+  fd = sfs_fopen((char *)name);
+  sfs_frseek(fd, 0);
+  got = sfs_fread(fd, data, size);
+  sfs_fclose(fd);
+  if (got != size) {
+    fprintf(stderr, "ERROR: %s: read %d bytes, expected %d\n", what, got, size);
+    errors++;
+    return;
+  }
+  for (i = 0; i < size; i++) {
+    if (data[i] != file_byte(i)) {
+      fprintf(stderr, "ERROR: %s: wrong data at %d\n", what, i);
+      errors++;
+      return;
+    }
+  }
+}
+
+int main(void)
+{
+  char buf[GROWN_FILE_BYTES];
+  char *record;
+  int i, fd;
+
+  for (i = 0; i < GROWN_FILE_BYTES; i++)
+    buf[i] = file_byte(i);
+  set_disk_backend(&RAM_DISK);
+  sfs_setdisk("test_inline");
+  if (sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, 100) == 0
+      || sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, 2 * BLOCK_BYTES) == 0
+      || sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, 32) == 0) {
+    fprintf(stderr, "ERROR: formatted with an invalid inode record size\n");
+    errors++;
+  }
+  if (sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, INODE_BYTES) < 0) {
+    fprintf(stderr, "ERROR: format failed\n");
+    return 1;
+  }
+
+  fd = sfs_fopen("inline");
+  for (i = 0; i < INLINE_FILE_BYTES; i += 100) {
+    int chunk = INLINE_FILE_BYTES - i < 100 ? INLINE_FILE_BYTES - i : 100;
+    if (sfs_fwrite(fd, buf + i, chunk) != chunk) {
+      fprintf(stderr, "ERROR: short write at %d\n", i);
+      errors++;
+    }
+  }
+  sfs_fclose(fd);
+  check_file("inline", "inline", INLINE_FILE_BYTES);
+  if (sfs_sync() < 0 || read_blocks(INODE_TABLE_BLOCK, 1, buf) < 0) {
+    fprintf(stderr, "ERROR: could not read the inode table\n");
+    return 1;
+  }
+  record = buf + FILE_INODE * INODE_BYTES;
+  for (i = 0; i < INLINE_FILE_BYTES; i++) {
+    if (record[2 * sizeof(int) + i] != file_byte(i)) {
+      fprintf(stderr, "ERROR: the file isn't stored in its inode record\n");
+      errors++;
+      break;
+    }
+  }
+  if (mksfs(0) < 0) {
+    fprintf(stderr, "ERROR: could not mount the disk again\n");
+    return 1;
+  }
+  check_file("inline, mounted again", "inline", INLINE_FILE_BYTES);
+
+  for (i = 0; i < GROWN_FILE_BYTES; i++)
+    buf[i] = file_byte(i);
+  fd = sfs_fopen("inline");
+  if (sfs_fwrite(fd, buf + INLINE_FILE_BYTES, GROWN_FILE_BYTES - INLINE_FILE_BYTES)
+      != GROWN_FILE_BYTES - INLINE_FILE_BYTES) {
+    fprintf(stderr, "ERROR: short write past the inode record\n");
+    errors++;
+  }
+  sfs_fclose(fd);
+  check_file("grown", "inline", GROWN_FILE_BYTES);
+  sfs_sync();
+  if (mksfs(0) < 0) {
+    fprintf(stderr, "ERROR: could not mount the disk again\n");
+    return 1;
+  }
+  check_file("grown, mounted again", "inline", GROWN_FILE_BYTES);
+
+  fprintf(stderr, "Inline test exiting with %d errors\n", errors);
+  return errors != 0;
+}
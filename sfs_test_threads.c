@@ -0,0 +1,145 @@
+/* sfs_test_threads.c
+ *
+ * Concurrency stress test, meant to be built with -fsanitize=thread (or
+ * address) as well as normally. Every thread repeatedly creates one of
+ * its files, writes it in uneven chunks, reads it back and checks the
+ * data and size, then closes it, while other threads list the directory,
+ * sync and look up sizes of files being written. The block cache is
+ * kept small so that blocks are evicted and written back while other
+ * threads have requests in flight. At the end the file system is
+ * mounted again and the last version of every file is checked.
+ *
+ * usage: ThreadTest [threads (default 8)]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_cache.h"
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define BLOCK_BYTES 1024
+#define BLOCK_COUNT 16384
+#define MAX_FILES 256
+#define CACHE_BLOCKS 48        /* small enough to keep the cache evicting */
+#define ROUNDS 30
+#define FILES_PER_THREAD 4
+#define MAX_FILE_BYTES 40000
+#define MAX_THREADS 64
+
+static int nthreads = 8;
+static int errors = 0;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void report_error(const char *what, const char *name, int got, int expected)
+{
+  pthread_mutex_lock(&error_lock);
+  fprintf(stderr, "ERROR: %s %s (%d, expected %d)\n", what, name, got, expected);
+  errors++;
+  pthread_mutex_unlock(&error_lock);
+}
+
+static void file_name(char *name, int thread, int round)
+{
+  sprintf(name, "t%dr%d", thread, round % FILES_PER_THREAD);
+}
+
+static int file_size(int thread, int round)
+{
+  return (round * 7919 + thread * 131) % MAX_FILE_BYTES;
+}
+
+static char file_byte(int thread, int round, int i)
+{
+  return (char)(i * (thread + 1) + round);
+}
+
+static void *worker(void *arg)
+{
+  int thread = (int)(long)arg;
+  char *buf = malloc(MAX_FILE_BYTES);
+  char *data = malloc(MAX_FILE_BYTES);
+  char name[21], next[21];
+  int round, i, fd, size, pos, chunk, got;
+
+  for (round = 0; round < ROUNDS; round++) {
+    file_name(name, thread, round);
+    sfs_remove(name);
+    fd = sfs_fopen(name);
+    if (fd < 0) {
+      report_error("open failed", name, fd, 0);
+      continue;
+    }
+    size = file_size(thread, round);
+    for (i = 0; i < size; i++)
+      buf[i] = file_byte(thread, round, i);
+    for (pos = 0; pos < size; pos += chunk) {
+      chunk = 1 + (pos * 13) % 5000;
+      if (chunk > size - pos)
+        chunk = size - pos;
+      if ((got = sfs_fwrite(fd, buf + pos, chunk)) != chunk) {
+        report_error("short write", name, got, chunk);
+        break;
+      }
+    }
+    if (round % 5 == 0 && sfs_fsync(fd) < 0)
+      report_error("fsync failed", name, -1, 0);
+    sfs_frseek(fd, 0);
+    for (pos = 0; (got = sfs_fread(fd, data + pos, 3000)) > 0; pos += got)
+      ;
+    if (pos != size || memcmp(data, buf, size) != 0)
+      report_error("wrong data read from", name, pos, size);
+    if ((got = sfs_getfilesize(name)) != size)
+      report_error("wrong size of", name, got, size);
+    sfs_fclose(fd);
+    sfs_getnextfilename(next);
+    /* look up a file another thread may be writing */
+    file_name(next, (thread + 1) % nthreads, round);
+    sfs_getfilesize(next);
+    if (thread == 0 && round % 7 == 0 && sfs_sync() < 0)
+      report_error("sync failed", name, -1, 0);
+  }
+  free(buf);
+  free(data);
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t threads[MAX_THREADS];
+  char name[21];
+  int i, round, size;
+
+  if (argc > 1)
+    nthreads = atoi(argv[1]);
+  if (nthreads < 1 || nthreads > MAX_THREADS) {
+    fprintf(stderr, "usage: %s [threads (1-%d)]\n", argv[0], MAX_THREADS);
+    return 1;
+  }
+  set_disk_backend(&RAM_DISK);
+  sfs_setdisk("test_threads");
+  if (sfs_format(BLOCK_BYTES, BLOCK_COUNT, MAX_FILES, SFS_DEFAULT_INODE_BYTES) < 0
+      || cache_setCapacity(CACHE_BLOCKS) < 0) {
+    fprintf(stderr, "ERROR: format failed\n");
+    return 1;
+  }
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  sfs_sync();
+
+  mksfs(0);
+  for (i = 0; i < nthreads; i++) {
+    for (round = ROUNDS - FILES_PER_THREAD; round < ROUNDS; round++) {
+      file_name(name, i, round);
+      size = file_size(i, round);
+      if (sfs_getfilesize(name) != size)
+        report_error("wrong size after mounting again of", name, sfs_getfilesize(name), size);
+    }
+  }
+  fprintf(stderr, "Thread test exiting with %d errors\n", errors);
+  return errors != 0;
+}